@@ -6,11 +6,30 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <unordered_map>
+#include <vector>
 #include <set>
 #include <algorithm>
+#include <chrono>
 
 #include "helper.h"
 #include "packetmanager.h"
+#include "routinetable.h"
+#include "blocktable.h"
+#include "snapshot.h"
+#include "tracelog.h"
+#include "dumpformat.h"
+#include "rowwriter.h"
+#include "statsregion.h"
+#include "symcache.h"
+#include "session.h"
+#include "zoom.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 
 //connection and logging data
@@ -24,303 +43,2595 @@ std::ofstream dbgLog;
 //Command line switches for this tool.
 KNOB<std::string> KnobOut(KNOB_MODE_WRITEONCE, "pintool", "o", "findspot.log", "write output to this file");
 KNOB<std::string> KnobDbg(KNOB_MODE_WRITEONCE, "pintool", "d", "", "write detailed debugging log to this file [default off]");
+KNOB<std::string> KnobTrace(KNOB_MODE_WRITEONCE, "pintool", "b", "", "write binary event log to this file, render with findspot-trace [default off]");
+KNOB<std::string> KnobShm(KNOB_MODE_WRITEONCE, "pintool", "shm", "", "publish candidates in this posix shared memory segment, view with findspot-cli watch [default off]");
+KNOB<std::string> KnobSymCache(KNOB_MODE_WRITEONCE, "pintool", "symcache", "", "cache the routines of every image in this directory, later runs load them from there [default off]");
+KNOB<bool> KnobRetire(KNOB_MODE_WRITEONCE, "pintool", "retire", "0", "stop instrumenting routines once they are trimmed");
+KNOB<UINT32> KnobSample(KNOB_MODE_WRITEONCE, "pintool", "sample", "0", "count at most this many hits per function and collect window, 0 counts all");
+KNOB<bool> KnobProbe(KNOB_MODE_WRITEONCE, "pintool", "probe", "0", "use probe mode instead of jit, near native speed but no freeze and no -b");
 KNOB<int> KnobPort(KNOB_MODE_WRITEONCE, "pintool", "p", to_string(FS_PORT), "port to listen on for controller");
 
 //port to listen on for controller connection
 int port = FS_PORT;
 
-//communication with controller
-FindSpotPacketManager manager;
+//communication with controllers, any number can be attached at the same time
+PIN_SOCKET listenfd = INVALID_SOCKET;
+std::vector<FindSpotPacketManager*> clients;
+
+//application threads stopped by freeze (or initially)
+bool frozen = false;
+
+//running with PIN_StartProgramProbed(), application threads can not be stopped
+bool probemode = false;
 
 
 
 bool execute_string_cmd(const std::string& cmd, std::string* result);
+void FlushRetired();
+
+//how long the target was stopped, per command (first word), see stats command
+struct StopStat
+{
+    UINT64 count = 0;
+    double total = 0; //ms
+    double max = 0;   //ms
+};
+std::map<std::string, StopStat> stopstats;
+
+/*
+* Commands that only read the data set, or switch the mode, run while the target keeps running.
+* Hit counters only grow while the target runs (trimming only zeroes them), so every row shown is
+* a count the id really had at some point during the command. A mode switch re-jits lazily, threads
+* still executing old code finish that trace with the previous mode.
+* Schedules only switch modes as well.
+* Everything that rewrites counters, flags or instrumented ranges (clear, filters, granularity,
+* retire, snapshot load) still stops the application threads.
+*/
+bool runs_concurrently(const std::string& cmd)
+{
+    if(cmd == "help" || cmd == "histogram" || cmd == "probes" || cmd == "granularity" || cmd == "stats")
+        return true;
+    if(cmd.find("show") == 0 || cmd.find("dump") == 0 || cmd.find("mode") == 0 || cmd.find("sort") == 0 || cmd.find("schedule") == 0)
+        return true;
+    if(cmd.find("session save") == 0 || cmd.find("zoom show") == 0)
+        return true;
+    return cmd.find("snapshot") == 0 && cmd.find("snapshot load") != 0;
+}
+
+std::string hello()
+{
+    if(probemode)
+        return "hello from findspot 1.0\nprobe mode, target running";
+    if(frozen)
+        return "hello from findspot 1.0\ntarget frozen, type unfreeze to continue execution";
+    return "hello from findspot 1.0\ntarget running";
+}
+
+//runs one command, the result is sent to the client that issued it
+std::string handle_command(const std::string& cmd)
+{
+    //handle some commands without freezing
+    if(probemode && (cmd == "freeze" || cmd == "unfreeze"))
+    {
+        return "not available in probe mode";
+    }
+    else if(cmd == "freeze")
+    {
+        if(frozen)
+            return "application frozen";
+        frozen = PIN_StopApplicationThreads(PIN_ThreadId());
+        return frozen ? "application frozen" : "freezing application failed";
+    }
+    else if(cmd == "unfreeze")
+    {
+        if(frozen)
+            PIN_ResumeApplicationThreads(PIN_ThreadId());
+        frozen = false;
+        return "target resumed";
+    }
+    else if(cmd == "kill")
+    {
+        return "not implemented";
+    }
+
+    //in probe mode all commands run concurrently with the application
+    const bool stop = !probemode && !frozen && !runs_concurrently(cmd);
+    const auto stopstart = std::chrono::steady_clock::now();
+    if(stop && !PIN_StopApplicationThreads(PIN_ThreadId()))
+    {
+        auto error = "PIN_StopApplicationThreads() failed, dropping command\n";
+        dbgLog << error;
+        std::cout << error;
+        return error;
+    }
+
+    //keeps image loads and jitting (which add routines and blocks) out while we read the tables
+    //concurrent commands only lock while they gather rows (see CollectRows), not while formatting
+    const bool locked = !runs_concurrently(cmd);
+    if(locked)
+        PIN_LockClient();
+
+    //retired routines are flushed in batches, dont leave a partial batch instrumented
+    FlushRetired();
+
+    std::string result;
+    bool executed = execute_string_cmd(cmd, &result);
+    if(locked)
+        PIN_UnlockClient();
+    if(stop)
+        PIN_ResumeApplicationThreads(PIN_ThreadId());
+
+    if(!executed)
+    {
+        std::cout << "command " << " returned error: " << result << std::endl;
+        dbgLog << "command " << " returned error: " << result << std::endl;
+        result = "unknown command";
+    }
+    if(stop)
+    {
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stopstart).count();
+        StopStat& stat = stopstats[cmd.substr(0, cmd.find(' '))];
+        stat.count++;
+        stat.total += ms;
+        stat.max = std::max(stat.max, ms);
+        result += "(target stopped for " + to_string(ms) + " ms)\n";
+    }
+    dbgLog << "command " << " returned: " << result << std::endl;
+    return result;
+}
+
+void add_client(PIN_SOCKET fd)
+{
+    if(fd == INVALID_SOCKET)
+        return;
+    FindSpotPacketManager* client = new FindSpotPacketManager(fd);
+    pin_setnonblocking(fd);
+    clients.push_back(client);
+    client->queue_reply(0, hello());
+    dbgLog << "controller attached, " << clients.size() << " connected" << std::endl;
+}
+
+//runs all complete requests of a client, false if it disconnected
+bool serve_client(FindSpotPacketManager* client, bool readable, bool writable)
+{
+    if(readable && !client->on_readable())
+        return false;
+
+    std::string cmd;
+    UINT32 request = 0;
+    while(client->next_request(cmd, request))
+    {
+        //switch to v2 framing, old clients never send this and keep the v1 framing
+        if(cmd == PROTOCOL_CMD && client->version == 1)
+        {
+            client->queue_reply(0, PROTOCOL_CMD);
+            client->version = 2;
+            continue;
+        }
+        if(!client->queue_reply(request, handle_command(cmd)))
+            return false;
+    }
+    return !writable || client->on_writable();
+}
 
 /*
-* Thread the continously listens for commands from controller.
-* This is a "internal" PIN thread spawned by PIN_SpawnInternalThread() upon controller connection.
+* Thread that continously serves the controllers.
+* This is a "internal" PIN thread spawned by PIN_SpawnInternalThread() upon the first controller connection.
+* One select() loop over the listening socket and all clients: controllers can attach, detach and
+* re-attach at any time without ending the session, replies are sent without blocking.
 */
 void control_thread(void* arg)
 {
     //not ideal, since we race the main program start, but good enough for now
-    PIN_StopApplicationThreads(PIN_ThreadId());
+    if(!probemode)
+        frozen = PIN_StopApplicationThreads(PIN_ThreadId());
+    add_client((PIN_SOCKET)(ADDRINT)arg);
 
-    int recv_failures = 0;
-    while(1)
+    while(!PIN_IsProcessExiting())
     {
-        std::string cmd = manager.recv_cmd_block();
-        if(cmd.empty())
+        pin_fd_set rds, wds;
+        FD_ZERO(&rds);
+        FD_ZERO(&wds);
+        FD_SET(listenfd, &rds);
+        PIN_SOCKET maxfd = listenfd;
+        for(FindSpotPacketManager* client : clients)
         {
-            if(recv_failures++ < 10)
-                continue;
-            else
-                break;
+            FD_SET(client->clientfd, &rds);
+            if(client->wants_write())
+                FD_SET(client->clientfd, &wds);
+            maxfd = std::max(maxfd, client->clientfd);
         }
 
-        recv_failures = 0;
+        pin_timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100 * 1000; //wake up now and then to notice process exit
+        const int ready = pin_select((int)maxfd + 1, &rds, &wds, NULL, &tv);
 
-        //handle some commands without freezing
-        if(cmd == "freeze")
+        //retired and saturated routines are flushed at least every 100ms, also without commands
+        FlushRetired();
+
+        if(ready < 0)
         {
-            if(PIN_StopApplicationThreads(PIN_ThreadId()))
-                manager.send_cmd("application frozen");
-            else
-                manager.send_cmd("freezing application failed");
+            PIN_Sleep(10);
             continue;
         }
-        else if(cmd == "unfreeze")
-        {
-            PIN_ResumeApplicationThreads(PIN_ThreadId());
-            manager.send_cmd("target resumed");
+        if(ready == 0)
             continue;
+
+        if(FD_ISSET(listenfd, &rds))
+            add_client(FindSpotPacketManager::accept_client(listenfd));
+
+        for(size_t i = 0; i < clients.size(); )
+        {
+            FindSpotPacketManager* client = clients[i];
+            if(serve_client(client, FD_ISSET(client->clientfd, &rds) != 0, FD_ISSET(client->clientfd, &wds) != 0))
+            {
+                i++;
+                continue;
+            }
+            clients.erase(clients.begin() + i);
+            delete client; //closes the socket
+            dbgLog << "controller detached, " << clients.size() << " connected" << std::endl;
         }
-        else if(cmd == "kill")
+    }
+}
+
+
+//waits for the first controller, later ones are accepted by the control thread
+int block_until_connect()
+{
+    listenfd = FindSpotPacketManager::listen_on(port);
+    if(listenfd == INVALID_SOCKET)
+    {
+        dbgLog << "listening on port " << port << " failed\n";
+        exit(-1);
+    }
+    PIN_SOCKET first = FindSpotPacketManager::accept_client(listenfd);
+
+    PIN_THREAD_UID listener_uid = 0;
+    THREADID thread_id = PIN_SpawnInternalThread(control_thread, (void*)(ADDRINT)first, 0, &listener_uid);
+    if ( thread_id == INVALID_THREADID )
+    {
+        dbgLog << "PIN_SpawnInternalThread(listener) failed\n";
+        exit(-1);
+    }
+
+    return first != INVALID_SOCKET;
+}
+
+
+//core functionality data
+
+//all hooked routines, indexed by a dense id
+RoutineTable routines;
+
+/*
+* Per-thread hit counters.
+* Every application thread gets its own shard on thread start, so the hot path increments
+* without atomics and without sharing cache lines between threads.
+* Counters are allocated in chunks on first touch by the owning thread and never move.
+* The counts are merged whenever they are read, together with the base counts of the set: counts of
+* exited threads and counts restored from a session. When a thread exits, its counts are added to
+* the base counts and its shard is handed to the next new thread.
+* The shard of a thread is held in a pin tool register, so the analysis code can be inlined.
+* Clearing only bumps the generation of the shard set. Every chunk remembers the generation it
+* was last reset in, a stale chunk reads as zero and is reset by the next hit that touches it,
+* so clear takes constant time and the jitted code keeps pointing at valid memory.
+*/
+const size_t SHARD_CHUNK_BITS = 12;
+const size_t SHARD_CHUNK_SIZE = size_t(1) << SHARD_CHUNK_BITS;
+const size_t SHARD_MAX_CHUNKS = 4096; //16M routines
+const UINT32 MAX_SHARDS = 1024;       //live threads beyond this share the last shard (counts may race)
+
+struct CounterShard
+{
+    explicit CounterShard(const volatile UINT32 *g) : generation(g) {}
+
+    UINT64* chunks[SHARD_MAX_CHUNKS]{};
+    UINT32 gens[SHARD_MAX_CHUNKS]{};     //generation of the last reset, 0 if never allocated
+    const volatile UINT32 *generation; //current generation of the shard set, starts at 1
+    UINT32 owners = 0;                 //threads using the shard, guarded by the lock of the set
+
+    //missing chunks are stale as well
+    bool stale(UINT32 chunk) const
+    {
+        return gens[chunk] != *generation;
+    }
+
+    //allocates or zeroes the chunk for the current generation
+    void refresh(UINT32 chunk)
+    {
+        if(!stale(chunk))
+            return;
+        if(!chunks[chunk])
+            chunks[chunk] = new UINT64[SHARD_CHUNK_SIZE]();
+        else
+            std::fill(chunks[chunk], chunks[chunk] + SHARD_CHUNK_SIZE, 0);
+        gens[chunk] = *generation;
+    }
+
+    UINT64& at(UINT32 id)
+    {
+        refresh(id >> SHARD_CHUNK_BITS);
+        return chunks[id >> SHARD_CHUNK_BITS][id & (SHARD_CHUNK_SIZE - 1)];
+    }
+
+    UINT64 get(UINT32 id) const
+    {
+        if(stale(id >> SHARD_CHUNK_BITS))
+            return 0;
+        return chunks[id >> SHARD_CHUNK_BITS][id & (SHARD_CHUNK_SIZE - 1)];
+    }
+
+    //adds the current counts of another shard
+    void add(const CounterShard& other)
+    {
+        for(UINT32 chunk = 0; chunk < SHARD_MAX_CHUNKS; chunk++)
         {
-            manager.send_cmd("not implemented");
-            break;
+            if(other.stale(chunk))
+                continue;
+            refresh(chunk);
+            for(size_t i = 0; i < SHARD_CHUNK_SIZE; i++)
+                chunks[chunk][i] += other.chunks[chunk][i];
         }
+    }
+
+    //drops all counts, the chunks are kept and zeroed on their next use
+    void invalidate()
+    {
+        std::fill(gens, gens + SHARD_MAX_CHUNKS, 0);
+    }
+
+    void reset(UINT32 id)
+    {
+        if(stale(id >> SHARD_CHUNK_BITS))
+            return;
+        UINT64 &c = chunks[id >> SHARD_CHUNK_BITS][id & (SHARD_CHUNK_SIZE - 1)];
+        if(c)
+            c = 0;
+    }
+};
+
+/*
+* The shards of all threads for one id space (routines, basic blocks).
+* Shards are only appended to (under lock) and kept until the tool exits.
+*/
+class ShardSet
+{
+public:
+    REG reg = REG_INVALID(); //tool register holding the shard of the current thread
 
+    void init()
+    {
+        PIN_InitLock(&lock);
+    }
 
-        if(!PIN_StopApplicationThreads(PIN_ThreadId()))
+    CounterShard* create(THREADID tid)
+    {
+        PIN_GetLock(&lock, tid + 1);
+        CounterShard* shard = nullptr;
+        if(!freeshards.empty())
         {
-            auto error = "PIN_StopApplicationThreads() failed, dropping command\n";
-            dbgLog << error;
-            std::cout << error;
-            manager.send_cmd(error);
-            continue;
+            shard = freeshards.back();
+            freeshards.pop_back();
+        }
+        else if(numshards < MAX_SHARDS)
+        {
+            shard = new CounterShard(&generation);
+            shards[numshards] = shard;
+            numshards = numshards + 1;
+        }
+        else
+        {
+            shard = shards[MAX_SHARDS - 1];
         }
+        shard->owners++;
+        PIN_ReleaseLock(&lock);
+        return shard;
+    }
 
-        std::string result;
-        bool executed = execute_string_cmd(cmd, &result);
-        if(!executed)
+    //the thread of the shard exited: keeps its counts and reuses the shard once no thread uses it
+    //readers must not merge meanwhile (they hold the client lock)
+    void release(CounterShard* shard, THREADID tid)
+    {
+        if(!shard)
+            return;
+        PIN_GetLock(&lock, tid + 1);
+        if(--shard->owners == 0)
         {
-            std::cout << "command " << " returned error: " << result << std::endl;
-            dbgLog << "command " << " returned error: " << result << std::endl;
-            result = "unknown command";
+            base.add(*shard);
+            shard->invalidate();
+            freeshards.push_back(shard);
         }
-        dbgLog << "command " << " returned: " << result << std::endl;
-        manager.send_cmd(result);
+        PIN_ReleaseLock(&lock);
+    }
 
-        PIN_ResumeApplicationThreads(PIN_ThreadId());
+    //merged hit count of an id over all threads
+    UINT64 merged(UINT32 id) const
+    {
+        UINT64 sum = base.get(id);
+        for(UINT32 i = 0; i < numshards; i++)
+            sum += shards[i]->get(id);
+        return sum;
+    }
+
+    //remove an id from the data set in all threads
+    //locked, so an exiting thread can not add the count back to base after it was reset
+    void trim(UINT32 id)
+    {
+        PIN_GetLock(&lock, PIN_ThreadId() + 1);
+        base.reset(id);
+        for(UINT32 i = 0; i < numshards; i++)
+            shards[i]->reset(id);
+        PIN_ReleaseLock(&lock);
+    }
+
+    //drops all counts in constant time, chunks are reset lazily
+    void reset_all()
+    {
+        generation = generation + 1;
+        if(!generation)
+            generation = 1; //0 marks chunks that were never allocated
+    }
+
+    //adds to the base count of an id, threads may run meanwhile
+    void restore(UINT32 id, UINT64 count, THREADID tid)
+    {
+        PIN_GetLock(&lock, tid + 1);
+        base.at(id) += count;
+        PIN_ReleaseLock(&lock);
     }
+
+    UINT32 size() const { return numshards; }
+
+private:
+    CounterShard* shards[MAX_SHARDS]{};
+    volatile UINT32 numshards = 0;
+    volatile UINT32 generation = 1;
+    CounterShard base{&generation}; //counts of exited threads and restored sessions, written under the lock
+    std::vector<CounterShard*> freeshards;
+    PIN_LOCK lock;
+};
+
+//counters of hooked routines
+ShardSet rtnshards;
+
+//basic blocks and their counters, only used in bbl granularity
+BlockTable blocks;
+ShardSet blockshards;
+
+//probe mode has no tool registers, shards are looked up by pin thread id and created on first use
+CounterShard* probeshards[MAX_SHARDS]{};
+PIN_LOCK probelock;
+
+void ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    PIN_SetContextReg(ctxt, rtnshards.reg, (ADDRINT)rtnshards.create(tid));
+    PIN_SetContextReg(ctxt, blockshards.reg, (ADDRINT)blockshards.create(tid));
+    dbgLog << "thread start: " << tid << " shards " << rtnshards.size() << std::endl;
 }
 
+void ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    PIN_LockClient(); //no command or stats update may merge while counts move
+    rtnshards.release((CounterShard*)PIN_GetContextReg(ctxt, rtnshards.reg), tid);
+    blockshards.release((CounterShard*)PIN_GetContextReg(ctxt, blockshards.reg), tid);
+    PIN_UnlockClient();
+    dbgLog << "thread fini: " << tid << std::endl;
+}
 
-int block_until_connect()
+UINT64 MergedCount(UINT32 id)
 {
-    manager.clientfd = manager.block_accept(port);
-    int sent = manager.send_cmd("hello from findspot 1.0\ntarget frozen, type unfreeze to continue execution");
+    return rtnshards.merged(id);
+}
 
-    PIN_THREAD_UID listener_uid = 0;
-    THREADID thread_id = PIN_SpawnInternalThread(control_thread, NULL, 0, &listener_uid);
-    if ( thread_id == INVALID_THREADID )
+void TrimCount(UINT32 id)
+{
+    routines.presence.clear(id);
+    rtnshards.trim(id);
+}
+
+//sort results chronological (true) or by hitcount (false)
+bool sortbychrono = false;
+
+//detach from the target as soon as possible
+volatile bool request_detach = false;
+
+//module blacklist+whitelist
+std::set<std::string> mod_white;
+std::set<std::string> mod_black;
+
+//returns false if the module should be ignored due to blacklist/whitelist
+bool should_consider_module(const std::string &str)
+{
+    if(mod_white.size())
+        return mod_white.count(str);
+    if(mod_black.size())
+        return !mod_black.count(str);
+    return true; // both lists empty
+}
+
+/*
+* Re-evaluates the white/blacklist for every loaded image after the lists changed.
+* Routines of images whose decision changed get their flag updated and only those images are
+* jitted again. Returns the number of affected images.
+*/
+size_t ApplyModuleFilter()
+{
+    std::vector<UINT8> changed(routines.imagecount());
+    size_t numchanged = 0;
+    for(UINT32 img = 0; img < routines.imagecount(); img++)
     {
-        dbgLog << "PIN_SpawnInternalThread(listener) failed\n";
-        exit(-1);
+        ImageInfo& info = routines.imagedata(img);
+        const bool enabled = should_consider_module(routines.imagename(img));
+        if(enabled != info.enabled)
+        {
+            info.enabled = enabled;
+            changed[img] = 1;
+            numchanged++;
+        }
+    }
+    if(!numchanged)
+        return 0;
+
+    const size_t total = routines.size();
+    for(UINT32 id = 0; id < total; id++)
+    {
+        const UINT32 img = routines.colddata(id).image;
+        if(!changed[img])
+            continue;
+        RtnHot& h = routines.hotdata(id);
+        if(routines.imagedata(img).enabled)
+            h.flags &= ~RTN_FLAG_FILTERED;
+        else
+            h.flags |= RTN_FLAG_FILTERED;
+    }
+
+    for(UINT32 img = 0; img < routines.imagecount() && !probemode; img++)
+        if(changed[img])
+            PIN_RemoveInstrumentationInRange(routines.imagedata(img).low, routines.imagedata(img).high);
+    return numchanged;
+}
+
+//controls whether we add or remove to/from our dataset
+enum class mode
+{
+    OFF,        //freeze current data
+    COLLECT,    //add executing functions to data
+    TRIM,       //remove executing functions from data
+};
+mode m = mode::OFF;
+
+//whether routine entries or basic blocks are counted
+enum class granularity
+{
+    RTN,
+    BBL,
+};
+granularity gran = granularity::RTN;
+
+/*
+* Sampling (sample command, -sample).
+* With a limit of K a routine is only counted for its first K hits per collect window, then its
+* instrumentation is removed like for retired routines. Hot routines (allocators, string ops)
+* cost K analysis calls instead of millions, the count reads as "at least K" (saturated).
+* Every new window instruments them again. Limits are per module, sample_default for all others.
+* Counting every Nth call instead would not help: the check itself costs as much as counting.
+*/
+UINT32 sample_default = 0;
+std::map<std::string, UINT32> sample_modules;
+
+UINT32 SampleLimitFor(const std::string& image)
+{
+    auto it = sample_modules.find(image);
+    return it == sample_modules.end() ? sample_default : it->second;
+}
+
+//limit of the image of a routine, 0 if all hits are counted
+UINT32 SampleLimit(UINT32 id)
+{
+    return routines.imagedata(routines.colddata(id).image).samplelimit;
+}
+
+void UnsaturateAll();
+
+//updates the limit of every loaded image after the configuration changed
+//routines saturated under the old limits are counted again, also if sampling is now off
+void ApplySampling()
+{
+    for(UINT32 img = 0; img < routines.imagecount(); img++)
+        routines.imagedata(img).samplelimit = SampleLimitFor(routines.imagename(img));
+    UnsaturateAll();
+    PIN_RemoveInstrumentation();
+}
+
+/*
+* First hit order (sort chrono).
+* Every routine keeps the sequence number of its first hit in the current collect window. The
+* sequence is a global counter that is only touched on those first hits, so further hits cost
+* nothing extra, and the order is the real execution order across all threads.
+* The instrumentation compares against the current window number at run time, so a new window
+* (mode collect, clear, snapshot load) gives every routine a new first hit without re-jitting.
+* A new window also restarts the sequence after the candidates, so it never grows beyond the
+* number of routines (and can not wrap) however many windows a session has.
+* Basic blocks have no first hit order, in bbl granularity chrono means the order they were jitted.
+*/
+volatile UINT32 hitwindow = 1;
+volatile UINT32 hitseq = 1; //0 is left for routines that were never hit (e.g. loaded from a snapshot)
+
+//first hit order of a routine, only meaningful among candidates
+UINT32 FirstHitOrder(UINT32 id)
+{
+    return (UINT32)routines.hotdata(id).firsthit;
+}
+
+void StampFirstHit(UINT64 *firsthit, UINT32 window)
+{
+    const UINT64 old = *firsthit;
+    if((UINT32)(old >> 32) == window)
+        return;
+    //two threads racing here both hit the routine at about the same time, either stamp is right
+    atomic_cas64(firsthit, old, (UINT64(window) << 32) | atomic_next32(&hitseq));
+}
+
+//renumbers the first hits of the candidates 1..n in their order, the next first hit gets n + 1
+void NewHitWindow()
+{
+    std::vector<std::pair<UINT32, UINT32>> hits; //order, id
+    routines.presence.foreach(routines.size(), [&hits](UINT32 id) {
+        if(FirstHitOrder(id))
+            hits.push_back({FirstHitOrder(id), id});
+    });
+    std::sort(hits.begin(), hits.end());
+
+    UINT32 seq = 1;
+    for(const auto& x : hits)
+    {
+        UINT64 *firsthit = &routines.hotdata(x.second).firsthit;
+        const UINT64 old = *firsthit;
+        //a thread that stamps the routine meanwhile wins, its stamp is of the running window
+        atomic_cas64(firsthit, old, (old & ~UINT64(UINT32(-1))) | seq++);
+    }
+    hitseq = seq;
+    hitwindow++;
+}
+
+//instrumentation depends on the mode, so all code has to be jitted again after a change
+void SetMode(mode mm)
+{
+    if(m == mm)
+        return;
+    m = mm;
+    if(m == mode::COLLECT)
+        NewHitWindow();
+    UnsaturateAll(); //a new window counts saturated routines again
+    if(!probemode) //probes check the mode at run time
+        PIN_RemoveInstrumentation();
+}
+
+/*
+* Retire on trim.
+* A trimmed routine can only become a candidate again after clear, so its instrumentation is
+* removed. Removal flushes code cache, so retired routines are queued and flushed in batches,
+* or by the control thread within 100ms.
+*/
+const size_t RETIRE_BATCH = 256;
+
+bool retire_on_trim = false;
+std::vector<UINT32> retire_pending;
+std::vector<UINT32> retired; //every routine flagged retired or saturated, so clear does not scan all routines
+PIN_LOCK retirelock;
+
+void FlushRetired()
+{
+    std::vector<UINT32> batch;
+    PIN_GetLock(&retirelock, PIN_ThreadId() + 1);
+    batch.swap(retire_pending);
+    PIN_ReleaseLock(&retirelock);
+
+    for(UINT32 id : batch)
+        PIN_RemoveInstrumentationInRange(routines.address(id), routines.address(id));
+    if(batch.size())
+        dbgLog << "retired " << batch.size() << " routines" << std::endl;
+}
+
+//flag is RTN_FLAG_RETIRED, or RTN_FLAG_SATURATED for sampling
+void RetireRoutine(UINT32 id, THREADID tid, UINT32 flag = RTN_FLAG_RETIRED)
+{
+    //every later hit until the flush ends here, without the lock (the locked check below decides)
+    if(routines.hotdata(id).flags & flag)
+        return;
+
+    bool flush = false;
+    PIN_GetLock(&retirelock, tid + 1);
+    RtnHot &h = routines.hotdata(id);
+    if(!(h.flags & flag))
+    {
+        if(!(h.flags & (RTN_FLAG_RETIRED | RTN_FLAG_SATURATED)))
+            retired.push_back(id);
+        h.flags |= flag;
+        retire_pending.push_back(id);
+        flush = retire_pending.size() >= RETIRE_BATCH;
+    }
+    PIN_ReleaseLock(&retirelock);
+
+    if(flush)
+        FlushRetired();
+}
+
+//retires a routine without flushing its code, for routines that were not jitted yet or when the caller re-jits everything
+void RetireUnflushed(UINT32 id)
+{
+    PIN_GetLock(&retirelock, PIN_ThreadId() + 1);
+    RtnHot &h = routines.hotdata(id);
+    if(!(h.flags & (RTN_FLAG_RETIRED | RTN_FLAG_SATURATED)))
+        retired.push_back(id);
+    h.flags |= RTN_FLAG_RETIRED;
+    PIN_ReleaseLock(&retirelock);
+}
+
+//makes all retired (and saturated) routines eligible for instrumentation again
+//only their code is jitted again, nothing at all if no routine was retired
+void UnretireAll()
+{
+    std::vector<UINT32> ids;
+    PIN_GetLock(&retirelock, PIN_ThreadId() + 1);
+    retire_pending.clear();
+    ids.swap(retired);
+    for(UINT32 id : ids)
+        routines.hotdata(id).flags &= ~(RTN_FLAG_RETIRED | RTN_FLAG_SATURATED);
+    PIN_ReleaseLock(&retirelock);
+
+    if(probemode || ids.empty())
+        return;
+    if(ids.size() > RETIRE_BATCH)
+    {
+        PIN_RemoveInstrumentation();
+        return;
+    }
+    for(UINT32 id : ids)
+        PIN_RemoveInstrumentationInRange(routines.address(id), routines.address(id));
+}
+
+//only clears the flags, callers re-jit anyway
+//saturated routines are listed in retired, so this does not depend on the current limits
+void UnsaturateAll()
+{
+    PIN_GetLock(&retirelock, PIN_ThreadId() + 1);
+    size_t keep = 0;
+    for(UINT32 id : retired)
+    {
+        RtnHot &h = routines.hotdata(id);
+        h.flags &= ~RTN_FLAG_SATURATED;
+        if(h.flags & RTN_FLAG_RETIRED)
+            retired[keep++] = id;
+    }
+    retired.resize(keep);
+    PIN_ReleaseLock(&retirelock);
+}
+
+std::string modetostring(mode mm)
+{
+    if(mm == mode::OFF)
+        return "OFF";
+    if(mm == mode::COLLECT)
+        return "COLLECT";
+    if(mm == mode::TRIM)
+        return "TRIM";
+    return "???";
+}
+
+
+/*
+Now some related functions.
+*/
+
+//one line of output, refers to the routine table instead of copying names
+struct PrintRow
+{
+    UINT32 id;
+    UINT32 order;
+    UINT64 count;
+};
+
+void BlockSymbol(UINT32 id, std::string& s);
+
+//module and symbol+offset of a basic block
+std::string BlockSymbol(UINT32 id)
+{
+    std::string s;
+    BlockSymbol(id, s);
+    return s;
+}
+
+//same, into a reused string
+void BlockSymbol(UINT32 id, std::string& s)
+{
+    const UINT32 rtn = blocks.routine(id);
+    s = routines.name(rtn);
+    s += '+';
+    append_hex(s, blocks.address(id) - routines.address(rtn));
+}
+
+//rows of the current data set, routines or blocks depending on granularity
+//only ids marked present are merged, so this is linear in the number of candidates
+//takes the client lock (recursive), so no counts move meanwhile; the rows can be formatted without it
+std::vector<PrintRow> CollectRows()
+{
+    std::vector<PrintRow> vec;
+    PIN_LockClient();
+    if(gran == granularity::BBL)
+    {
+        vec.reserve(blocks.presence.count());
+        //blocks are numbered in jit order, which is what order means for routines too
+        blocks.presence.foreach(blocks.size(), [&vec](UINT32 id) { vec.push_back({id, id, blockshards.merged(id)}); });
+    }
+    else
+    {
+        vec.reserve(routines.presence.count());
+        const bool sampling = sample_default || !sample_modules.empty();
+        routines.presence.foreach(routines.size(), [&vec, sampling](UINT32 id) {
+            UINT64 count = MergedCount(id);
+            //every thread may count up to the limit, saturated counts read as the limit
+            if(sampling && SampleLimit(id))
+                count = std::min<UINT64>(count, SampleLimit(id));
+            if(count)
+                vec.push_back({id, FirstHitOrder(id), count});
+        });
+    }
+    PIN_UnlockClient();
+    return vec;
+}
+
+/*
+* Prints the first n rows in the current sort order.
+* Only the printed rows are sorted (partial sort), the "#" column is the rank in chronological
+* order among all rows, computed with a bitmap over the order values instead of a second sort.
+*/
+template<typename Stream>
+void PrintRows(Stream& ss, std::vector<PrintRow>& vec, bool blockrows, size_t n)
+{
+    const auto bychrono = [](const PrintRow &a, const PrintRow &b) { return a.order < b.order; };
+    const auto byhits = [](const PrintRow &a, const PrintRow &b) { return a.count != b.count ? a.count > b.count : a.order < b.order; };
+
+    const size_t k = std::min(n, vec.size());
+    if(sortbychrono)
+    {
+        std::partial_sort(vec.begin(), vec.begin() + k, vec.end(), bychrono);
+        for(size_t i = 0; i < k; i++)
+            vec[i].order = (UINT32)i;
+    }
+    else
+    {
+        std::vector<UINT64> orderbits;
+        for(const PrintRow& x : vec)
+        {
+            if(x.order / 64 >= orderbits.size())
+                orderbits.resize(x.order / 64 + 1);
+            orderbits[x.order / 64] |= UINT64(1) << (x.order % 64);
+        }
+        std::vector<UINT32> prefix(orderbits.size());
+        for(size_t w = 1; w < orderbits.size(); w++)
+            prefix[w] = prefix[w - 1] + popcount64(orderbits[w - 1]);
+
+        std::partial_sort(vec.begin(), vec.begin() + k, vec.end(), byhits);
+        for(size_t i = 0; i < k; i++)
+        {
+            const UINT32 o = vec[i].order;
+            vec[i].order = prefix[o / 64] + popcount64(orderbits[o / 64] & ((UINT64(1) << (o % 64)) - 1));
+        }
+    }
+
+    //formatted by hand into one buffer, with 200k rows stream formatting dominated the time
+    //the application threads were stopped
+    const int ww[]{NumDigits((int)vec.size()), 18, 10, 20, 0};
+    RowWriter<Stream, 5> w(ss, ww);
+    w.str("#");
+    w.str("Address");
+    w.str("Hits");
+    w.str("Module");
+    w.str("Symbol");
+    w.end();
+
+    std::string sym;
+    for(size_t i = 0; i < k; i++)
+    {
+        const PrintRow& x = vec[i];
+        const UINT32 rtn = blockrows ? blocks.routine(x.id) : x.id;
+        w.dec(x.order);
+        w.hex(blockrows ? blocks.address(x.id) : routines.address(rtn));
+        w.dec(x.count);
+        w.str(routines.image(rtn));
+        if(blockrows)
+        {
+            BlockSymbol(x.id, sym);
+            w.str(sym);
+        }
+        else
+        {
+            w.str(routines.name(rtn));
+        }
+        w.end();
+    }
+    if(k < vec.size())
+        w.line("<...>");
+    sym = "Total Count: ";
+    append_dec(sym, vec.size());
+    w.line(sym);
+}
+
+template<typename Stream>
+void PrintData(Stream& ss, size_t n = INT32_MAX)
+{
+    std::vector<PrintRow> vec = CollectRows();
+    PrintRows(ss, vec, gran == granularity::BBL, n);
+}
+
+std::string PrintData(size_t n = INT32_MAX)
+{
+    std::stringstream ss;
+    PrintData(ss, n);
+    return ss.str();
+}
+
+/*
+* Queries on the current data set, e.g. "show module=foo hits>=3".
+* Every query is a single linear pass over the candidates, only the printed rows are sorted.
+*/
+struct Query
+{
+    UINT64 minhits = 1;
+    UINT64 maxhits = UINT64(-1);
+    std::string module;
+    std::string symbol; //substring
+    size_t limit = 20;
+};
+
+bool IsNumber(const std::string& s)
+{
+    return !s.empty() && s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+//parses "hits=6 hits=6..12 hits>=3 hits<=3 hits>3 hits<3 module=foo symbol=bar limit=50"
+bool ParseQuery(const std::string& args, Query* q, std::string* error)
+{
+    std::istringstream in(args);
+    std::string term;
+    while(in >> term)
+    {
+        size_t pos = term.find_first_of("=<>");
+        if(pos == std::string::npos)
+        {
+            *error = "bad query term: " + term + "\n";
+            return false;
+        }
+        const std::string key = term.substr(0, pos);
+        std::string op = term.substr(pos, term[pos + 1] == '=' ? 2 : 1);
+        const std::string value = term.substr(pos + op.size());
+        if(value.empty())
+        {
+            *error = "missing value: " + term + "\n";
+            return false;
+        }
+
+        if(key == "hits")
+        {
+            const size_t range = op == "=" ? value.find("..") : std::string::npos;
+            const std::string low = value.substr(0, range);
+            const std::string high = range == std::string::npos ? low : value.substr(range + 2);
+            if(!IsNumber(low) || !IsNumber(high))
+            {
+                *error = "bad number: " + term + "\n";
+                return false;
+            }
+            const UINT64 v = std::strtoull(low.c_str(), nullptr, 10);
+            if(op == "<" && !v)
+            {
+                *error = "no hit count is below 0: " + term + "\n";
+                return false;
+            }
+            if(range != std::string::npos)
+            {
+                q->minhits = v;
+                q->maxhits = std::strtoull(high.c_str(), nullptr, 10);
+            }
+            else if(op == "=")
+                q->minhits = q->maxhits = v;
+            else if(op == ">=")
+                q->minhits = v;
+            else if(op == ">")
+                q->minhits = v + 1;
+            else if(op == "<=")
+                q->maxhits = v;
+            else if(op == "<")
+                q->maxhits = v - 1;
+            else
+            {
+                *error = "bad operator: " + term + "\n";
+                return false;
+            }
+        }
+        else if(key == "module" && op == "=")
+            q->module = value;
+        else if(key == "symbol" && op == "=")
+            q->symbol = value;
+        else if(key == "limit" && op == "=")
+        {
+            if(!IsNumber(value))
+            {
+                *error = "bad number: " + term + "\n";
+                return false;
+            }
+            q->limit = std::strtoull(value.c_str(), nullptr, 10);
+        }
+        else
+        {
+            *error = "bad query term: " + term + "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string RunQuery(const Query& q)
+{
+    const bool blockrows = gran == granularity::BBL;
+    std::vector<PrintRow> vec = CollectRows();
+    vec.erase(std::remove_if(vec.begin(), vec.end(), [&q, blockrows](const PrintRow& x) {
+        if(x.count < q.minhits || x.count > q.maxhits)
+            return true;
+        const UINT32 rtn = blockrows ? blocks.routine(x.id) : x.id;
+        if(!q.module.empty() && routines.image(rtn) != q.module)
+            return true;
+        if(!q.symbol.empty() && routines.name(rtn).find(q.symbol) == std::string::npos)
+            return true;
+        return false;
+    }), vec.end());
+
+    std::stringstream ss;
+    PrintRows(ss, vec, blockrows, q.limit);
+    return ss.str();
+}
+
+//number of candidates per hit count, one linear pass
+std::string Histogram()
+{
+    const size_t MAX_LINES = 64;
+
+    std::map<UINT64, size_t> hist;
+    for(const PrintRow& x : CollectRows())
+        hist[x.count]++;
+
+    std::stringstream ss;
+    const int ww[]{20, 10};
+    print_aligned(ss, ww, "Hits", "Count");
+    size_t lines = 0;
+    for(auto it = hist.begin(); it != hist.end(); ++it)
+    {
+        if(++lines == MAX_LINES)
+        {
+            size_t rest = 0;
+            for(auto r = it; r != hist.end(); ++r)
+                rest += r->second;
+            print_aligned(ss, ww, ">=" + to_string(it->first), rest);
+            break;
+        }
+        print_aligned(ss, ww, it->first, it->second);
+    }
+    return ss.str();
+}
+
+void SessionEnd();
+
+//routines stay registered (and instrumented), only their counts are dropped
+//constant time apart from the presence bitmaps (one bit per id) and retired routines
+void ClearData()
+{
+    SessionEnd();
+    rtnshards.reset_all();
+    routines.presence.clearall();
+    blockshards.reset_all();
+    blocks.presence.clearall();
+    NewHitWindow();
+    UnretireAll();
+}
+
+/*
+* Named snapshots of the data set, see snapshot command.
+*/
+std::map<std::string, Snapshot> snapshots;
+
+Snapshot TakeSnapshot()
+{
+    Snapshot snap;
+    snap.blocks = gran == granularity::BBL;
+    snap.resize(snap.blocks ? blocks.size() : routines.size());
+    for(const PrintRow& row : CollectRows())
+        if(row.id < snap.size())
+            snap.set(row.id, row.count);
+    return snap;
+}
+
+//replaces the current data set with the snapshot
+void LoadSnapshot(const Snapshot& snap)
+{
+    if(snap.blocks)
+    {
+        blockshards.reset_all();
+        blocks.presence.clearall();
+        snap.foreach([](UINT32 id, UINT64 count) { blocks.presence.set(id); blockshards.restore(id, count, PIN_ThreadId()); });
+    }
+    else
+    {
+        rtnshards.reset_all();
+        routines.presence.clearall();
+        snap.foreach([](UINT32 id, UINT64 count) { routines.presence.set(id); rtnshards.restore(id, count, PIN_ThreadId()); });
+        //routines hit earlier in this window but not in the snapshot must be able to come back
+        NewHitWindow();
+    }
+}
+
+std::string SnapshotCommand(const std::string& args)
+{
+    std::stringstream ss;
+    std::istringstream in(args);
+    std::string sub, name;
+    in >> sub >> name;
+
+    if(sub == "list")
+    {
+        for(const auto& x : snapshots)
+            ss << x.first << ": " << x.second.population() << (x.second.blocks ? " blocks" : " functions") << "\n";
+        ss << snapshots.size() << " snapshots" << std::endl;
+    }
+    else if(sub == "save" && !name.empty())
+    {
+        snapshots[name] = TakeSnapshot();
+        ss << "saved " << name << ": " << snapshots[name].population() << " entries" << std::endl;
+    }
+    else if(sub == "delete" && snapshots.erase(name))
+    {
+        ss << "deleted " << name << std::endl;
+    }
+    else if((sub == "show" || sub == "load") && snapshots.count(name))
+    {
+        const Snapshot& snap = snapshots[name];
+        if(sub == "load")
+        {
+            if(snap.blocks != (gran == granularity::BBL))
+                return "snapshot was taken with a different granularity\n";
+            LoadSnapshot(snap);
+            ss << "loaded " << name << std::endl;
+        }
+        std::vector<PrintRow> vec;
+        snap.foreach([&vec, &snap](UINT32 id, UINT64 count) { vec.push_back({id, snap.blocks ? id : FirstHitOrder(id), count}); });
+        PrintRows(ss, vec, snap.blocks, 20);
+    }
+    else if(sub == "combine")
+    {
+        //snapshot combine <name> = <a> <op> <b>
+        std::string eq, a, op, b;
+        in >> eq >> a >> op >> b;
+        if(name.empty() || eq != "=" || !snapshots.count(a) || !snapshots.count(b) || (op != "&" && op != "|" && op != "-"))
+            return "usage: snapshot combine <name> = <a> &|- <b> (a and b must exist)\n";
+        if(snapshots[a].blocks != snapshots[b].blocks)
+            return "snapshots were taken with different granularity\n";
+        const SnapshotOp sop = op == "&" ? SnapshotOp::AND : op == "|" ? SnapshotOp::OR : SnapshotOp::DIFF;
+        snapshots[name] = CombineSnapshots(snapshots[a], snapshots[b], sop);
+        ss << name << " = " << a << " " << op << " " << b << ": " << snapshots[name].population() << " entries" << std::endl;
+    }
+    else
+    {
+        ss << "unknown snapshot or command, see help" << std::endl;
+    }
+    return ss.str();
+}
+
+//identifies the file version of an image, reads the file on first use only (symcache and sessions)
+const std::string& ImageKey(UINT32 image)
+{
+    if(!routines.haskey(image))
+        routines.setimagekey(image, SymCacheKey(routines.imagepath(image)));
+    return routines.imagekey(image);
+}
+
+/*
+* Sessions, see session command.
+* A session file keeps the candidates relative to their module, so a long trim session survives
+* a restart of the target. After loading, entries are matched to images already loaded and to
+* images loaded later (at ImgLoad, through an index by module name). Only the restored candidates
+* stay instrumented, the other routines are retired until clear or retire off.
+*/
+struct SessionModuleEntries
+{
+    std::string key;
+    std::vector<std::pair<UINT64, UINT64>> entries; //rva, count
+};
+
+std::unordered_map<std::string, SessionModuleEntries> session_pending; //by module name, not loaded yet
+bool session_restrict = false;
+
+void SessionEnd()
+{
+    session_pending.clear();
+    session_restrict = false;
+}
+
+std::string SessionSave(const std::string& path)
+{
+    Session s;
+    s.mode = (uint32_t)m;
+    std::map<UINT32, uint32_t> modules; //image -> module in the session
+    const std::vector<PrintRow> rows = CollectRows();
+    PIN_LockClient(); //keys are interned while images load
+    for(const PrintRow& row : rows)
+    {
+        const RtnCold& c = routines.colddata(row.id);
+        auto it = modules.find(c.image);
+        if(it == modules.end())
+            it = modules.emplace(c.image, s.addmodule(routines.imagename(c.image), ImageKey(c.image))).first;
+        SessionEntry e{};
+        e.rva = c.rva;
+        e.count = row.count;
+        e.module = it->second;
+        s.entries.push_back(e);
+    }
+    PIN_UnlockClient();
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if(!file.is_open())
+        return "could not open file " + path + "\n";
+    WriteSession(file, s);
+    return "saved " + to_string(s.entries.size()) + " candidates of " + to_string(s.modules.size()) + " modules\n";
+}
+
+//restores the saved candidates of an image, returns the number of matched entries
+size_t SessionApply(UINT32 image)
+{
+    auto it = session_pending.find(routines.imagename(image));
+    if(it == session_pending.end())
+        return 0;
+
+    size_t matched = 0;
+    const std::string& key = ImageKey(image);
+    if(it->second.key.empty() || key.empty() || it->second.key == key)
+    {
+        const ADDRINT low = routines.imagedata(image).low;
+        for(const auto& e : it->second.entries)
+        {
+            const UINT32 id = routines.find(low + e.first);
+            if(id == RoutineTable::INVALID_ID)
+                continue;
+            //the data was cleared at session load, so the restored count adds to whatever the threads count
+            routines.presence.set(id);
+            rtnshards.restore(id, e.second, PIN_ThreadId());
+            matched++;
+        }
+    }
+    else
+    {
+        dbgLog << "session: " << it->first << " was rebuilt, its candidates are dropped" << std::endl;
+    }
+    session_pending.erase(it);
+    return matched;
+}
+
+//called at ImgLoad, first is the first routine id of the image
+void SessionImageLoaded(UINT32 image, size_t first)
+{
+    SessionApply(image);
+    for(size_t id = first; id < routines.size(); id++)
+        if(!routines.presence.test((UINT32)id))
+            RetireUnflushed((UINT32)id);
+}
+
+std::string SessionLoad(const std::string& path)
+{
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if(!file.is_open())
+        return "could not open file " + path + "\n";
+    const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    Session s;
+    if(!ReadSession(data, s))
+        return path + " is not a session file\n";
+
+    ClearData();
+    for(const SessionEntry& e : s.entries)
+    {
+        const SessionModule& mod = s.modules[e.module];
+        SessionModuleEntries& x = session_pending[s.string(mod.name)];
+        x.key = s.string(mod.key);
+        x.entries.emplace_back(e.rva, e.count);
+    }
+    session_restrict = true;
+
+    //the most recent image wins if a module was loaded several times
+    size_t matched = 0;
+    for(UINT32 image = (UINT32)routines.imagecount(); image-- > 0;)
+        matched += SessionApply(image);
+    const UINT32 total = (UINT32)routines.size();
+    for(UINT32 id = 0; id < total; id++)
+        if(!routines.presence.test(id))
+            RetireUnflushed(id);
+    if(!probemode)
+        PIN_RemoveInstrumentation();
+    if(s.mode <= (uint32_t)mode::TRIM)
+        SetMode((mode)s.mode);
+
+    std::stringstream ss;
+    ss << "restored " << matched << " of " << s.entries.size() << " candidates, "
+       << session_pending.size() << " modules not loaded yet, mode " << modetostring(m) << std::endl;
+    return ss.str();
+}
+
+std::string SessionCommand(const std::string& args)
+{
+    std::istringstream in(args);
+    std::string sub, path;
+    in >> sub >> path;
+    if((sub != "save" && sub != "load") || path.empty())
+        return "usage: session save|load <file>\n";
+    if(gran == granularity::BBL)
+        return "sessions are only available in function granularity\n";
+    return sub == "save" ? SessionSave(path) : SessionLoad(path);
+}
+
+/*
+* Zoom, see zoom command.
+* Once trimming has narrowed the candidates down, zoom re-jits and instruments only them, but in
+* more detail: executions of every basic block, call sites and optionally the most recent argument
+* registers. All other code runs without instrumentation. Mode and counts work as usual on the
+* zoomed routines.
+*/
+const size_t ZOOM_MAX_ROUTINES = 1024;
+
+std::map<UINT32, ZoomRoutine*> zoomed; //routine id -> details, empty if not zoomed
+UINT32 zoomargs = 0;
+
+//details are kept until the tool exits, jitted code of an earlier zoom may still refer to them
+std::string ZoomStart(UINT32 args)
+{
+    std::set<UINT32> ids;
+    const bool blockrows = gran == granularity::BBL;
+    for(const PrintRow& row : CollectRows())
+        ids.insert(blockrows ? blocks.routine(row.id) : row.id);
+    if(ids.empty())
+        return "no candidates to zoom into\n";
+    if(ids.size() > ZOOM_MAX_ROUTINES)
+        return "too many candidates (" + to_string(ids.size()) + " functions), trim first\n";
+
+    zoomed.clear();
+    for(UINT32 id : ids)
+    {
+        ZoomRoutine* z = new ZoomRoutine();
+        z->id = id;
+        zoomed[id] = z;
+    }
+    zoomargs = std::min(args, ZOOM_MAX_ARGS);
+    PIN_RemoveInstrumentation();
+    return "zoomed into " + to_string(ids.size()) + " functions, recording " + to_string(zoomargs) + " arguments\n";
+}
+
+std::string ZoomStop()
+{
+    if(zoomed.empty())
+        return "not zoomed\n";
+    zoomed.clear();
+    PIN_RemoveInstrumentation();
+    return "zoom off, all functions are instrumented again\n";
+}
+
+//symbol+offset of a code address, e.g. a call site
+std::string DescribeAddress(ADDRINT adr)
+{
+    PIN_LockClient();
+    RTN rtn = RTN_FindByAddress(adr);
+    const std::string s = RTN_Valid(rtn) ? RTN_Name(rtn) + "+" + tohex(adr - RTN_Address(rtn)) : "???";
+    PIN_UnlockClient();
+    return s;
+}
+
+std::string ZoomShow(size_t rows)
+{
+    if(zoomed.empty())
+        return "not zoomed, see help\n";
+
+    std::vector<const ZoomRoutine*> vec;
+    for(const auto& x : zoomed)
+        vec.push_back(x.second);
+    std::sort(vec.begin(), vec.end(), [](const ZoomRoutine* a, const ZoomRoutine* b) { return a->calls > b->calls; });
+
+    std::stringstream ss;
+    for(size_t i = 0; i < vec.size() && i < rows; i++)
+    {
+        const ZoomRoutine& z = *vec[i];
+        const ADDRINT adr = routines.address(z.id);
+        ss << tohex(adr) << " " << routines.image(z.id) << " " << routines.name(z.id) << ": " << z.calls << " calls\n";
+
+        ss << "  blocks:\n";
+        for(const auto& b : z.blocks)
+            ss << "    +" << std::setw(6) << std::left << tohex(b.first - adr) << std::right << " " << b.second << "\n";
+
+        std::vector<std::pair<UINT64, ADDRINT>> sites;
+        z.callsites.foreach([&sites](ADDRINT ret, UINT64 count) { sites.push_back({count, ret}); });
+        std::sort(sites.rbegin(), sites.rend());
+        ss << "  call sites:\n";
+        for(const auto& x : sites)
+            ss << "    " << tohex(x.second) << " " << DescribeAddress(x.second) << " " << x.first << "\n";
+        if(z.callsites.overflow())
+            ss << "    other " << z.callsites.overflow() << "\n";
+
+        const UINT32 pos = z.argpos;
+        const UINT32 recorded = std::min(pos, ZOOM_RING);
+        if(zoomargs && recorded)
+        {
+            ss << "  last arguments:\n";
+            for(UINT32 k = 0; k < recorded; k++)
+            {
+                const UINT32 slot = (pos - 1 - k) % ZOOM_RING;
+                ss << "   ";
+                for(UINT32 a = 0; a < zoomargs; a++)
+                    ss << " " << tohex(z.args[slot][a]);
+                ss << "\n";
+            }
+        }
+    }
+    ss << zoomed.size() << " functions zoomed" << std::endl;
+    return ss.str();
+}
+
+std::string ZoomCommand(const std::string& args)
+{
+    std::istringstream in(args);
+    std::string sub;
+    in >> sub;
+    if(sub.empty())
+        return ZoomStart(0);
+    if(sub == "args")
+    {
+        UINT32 n = 0;
+        if(!(in >> n))
+            return "usage: zoom args <n>\n";
+        return ZoomStart(n);
+    }
+    if(sub == "off")
+        return ZoomStop();
+    if(sub == "show")
+    {
+        size_t rows = 20;
+        in >> rows;
+        return ZoomShow(rows);
+    }
+    return "unknown zoom command, see help\n";
+}
+
+/*
+* Timed mode changes, see schedule command, e.g. "schedule collect 3s; trim 60s; off".
+* Every step switches the mode and lasts a fixed time or until the number of candidates crosses
+* a threshold. An internal thread runs the steps, so collect/trim windows are exact to a few ms
+* instead of the time it takes to switch windows and type.
+* Schedule state is guarded by schedulelock. The client lock is only taken to switch the mode,
+* an idle scheduler sleeps on schedulewake until the next schedule starts.
+*/
+const UINT32 SCHEDULE_IDLE_MS = 500; //only bounds how late the idle thread notices the process exit
+const UINT32 SCHEDULE_POLL_MS = 10; //threshold checks, and the longest sleep before a deadline
+
+struct ScheduleStep
+{
+    mode target = mode::OFF;
+    UINT64 duration = 0;  //ms, 0 if the step has no time limit
+    bool bythreshold = false;
+    bool below = false;   //until candidates <= threshold, else >= threshold
+    UINT64 threshold = 0;
+};
+
+std::vector<ScheduleStep> schedule;
+size_t schedule_step = 0; //running step, schedule.size() if done
+std::chrono::steady_clock::time_point schedule_stepstart;
+PIN_THREAD_UID schedule_thread_uid = 0;
+bool schedule_thread_running = false;
+PIN_LOCK schedulelock;
+PIN_SEMAPHORE schedulewake; //set when a schedule starts or is cancelled
+
+size_t CandidateCount()
+{
+    return gran == granularity::BBL ? blocks.presence.count() : routines.presence.count();
+}
+
+std::string ScheduleStepToString(const ScheduleStep& step)
+{
+    std::string s = modetostring(step.target);
+    if(step.duration)
+        s += " " + to_string(step.duration) + "ms";
+    if(step.bythreshold)
+        s += std::string(" until candidates") + (step.below ? "<=" : ">=") + to_string(step.threshold);
+    return s;
+}
+
+//"collect 3s", "trim 500ms", "trim 60s until candidates<=20", "off"
+bool ParseScheduleStep(const std::string& text, ScheduleStep* step, std::string* error)
+{
+    std::istringstream in(text);
+    std::string name, arg;
+    in >> name;
+    if(name == "collect")
+        step->target = mode::COLLECT;
+    else if(name == "trim")
+        step->target = mode::TRIM;
+    else if(name == "off")
+        step->target = mode::OFF;
+    else
+    {
+        *error = "bad mode in schedule: " + text + "\n";
+        return false;
+    }
+
+    while(in >> arg)
+    {
+        if(arg == "until")
+        {
+            std::string cond;
+            in >> cond;
+            const size_t op = cond.find_first_of("<>");
+            if(cond.find("candidates") != 0 || op == std::string::npos || cond.size() < op + 3 || cond[op + 1] != '=')
+            {
+                *error = "bad condition, use candidates<=N or candidates>=N: " + text + "\n";
+                return false;
+            }
+            step->bythreshold = true;
+            step->below = cond[op] == '<';
+            step->threshold = std::strtoull(cond.c_str() + op + 2, nullptr, 10);
+            continue;
+        }
+
+        char* unit = nullptr;
+        const UINT64 v = std::strtoull(arg.c_str(), &unit, 10);
+        const std::string u = unit;
+        if(u == "ms")
+            step->duration = v;
+        else if(u == "s")
+            step->duration = v * 1000;
+        else if(u == "m")
+            step->duration = v * 60 * 1000;
+        if(!v || (u != "ms" && u != "s" && u != "m"))
+        {
+            *error = "bad duration, use <n>ms, <n>s or <n>m: " + text + "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+void ScheduleStartStep(size_t i)
+{
+    schedule_step = i;
+    schedule_stepstart = std::chrono::steady_clock::now();
+    if(i < schedule.size())
+    {
+        PIN_LockClient();
+        SetMode(schedule[i].target);
+        PIN_UnlockClient();
+        dbgLog << "schedule step " << i + 1 << ": " << ScheduleStepToString(schedule[i]) << std::endl;
+    }
+}
+
+//advances the schedule, returns how long to sleep, schedulelock held
+UINT32 ScheduleTick()
+{
+    if(schedule_step >= schedule.size())
+        return SCHEDULE_IDLE_MS;
+
+    const ScheduleStep& step = schedule[schedule_step];
+    const UINT64 elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - schedule_stepstart).count();
+    bool done = step.duration && elapsed >= step.duration;
+    if(step.bythreshold)
+    {
+        const size_t n = CandidateCount();
+        done = done || (step.below ? n <= step.threshold : n >= step.threshold);
+    }
+    //the last step without limit just sets the mode
+    if(!step.duration && !step.bythreshold)
+        done = true;
+
+    if(done)
+    {
+        ScheduleStartStep(schedule_step + 1);
+        return 0;
+    }
+    if(step.duration && !step.bythreshold)
+        return (UINT32)std::min<UINT64>(step.duration - elapsed, SCHEDULE_POLL_MS);
+    return SCHEDULE_POLL_MS;
+}
+
+void schedule_thread(void* arg)
+{
+    while(!PIN_IsProcessExiting())
+    {
+        PIN_GetLock(&schedulelock, PIN_ThreadId() + 1);
+        const UINT32 sleep = ScheduleTick();
+        PIN_ReleaseLock(&schedulelock);
+        if(sleep && PIN_SemaphoreTimedWait(&schedulewake, sleep))
+            PIN_SemaphoreClear(&schedulewake);
+    }
+}
+
+std::string ScheduleCommandLocked(const std::string& args)
+{
+    std::stringstream ss;
+    const std::string text = TrimWhitespace(args);
+    if(text.empty())
+    {
+        if(schedule_step >= schedule.size())
+            return "no schedule running\n";
+        for(size_t i = 0; i < schedule.size(); i++)
+            ss << (i == schedule_step ? "-> " : "   ") << ScheduleStepToString(schedule[i]) << "\n";
+        const UINT64 elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - schedule_stepstart).count();
+        ss << "current step running for " << elapsed << "ms, " << CandidateCount() << " candidates" << std::endl;
+        return ss.str();
+    }
+    if(text == "cancel")
+    {
+        schedule.clear();
+        schedule_step = 0;
+        PIN_SemaphoreSet(&schedulewake);
+        return "schedule cancelled, mode stays " + modetostring(m) + "\n";
+    }
+
+    std::vector<ScheduleStep> steps;
+    std::istringstream in(text);
+    std::string part, error;
+    while(std::getline(in, part, ';'))
+    {
+        if(TrimWhitespace(part).empty())
+            continue;
+        ScheduleStep step;
+        if(!ParseScheduleStep(part, &step, &error))
+            return error;
+        steps.push_back(step);
+    }
+    if(steps.empty())
+        return "empty schedule\n";
+    for(size_t i = 0; i + 1 < steps.size(); i++)
+        if(!steps[i].duration && !steps[i].bythreshold)
+            return "only the last step can run without duration or condition: " + ScheduleStepToString(steps[i]) + "\n";
+
+    if(!schedule_thread_running)
+    {
+        if(PIN_SpawnInternalThread(schedule_thread, NULL, 0, &schedule_thread_uid) == INVALID_THREADID)
+            return "could not start scheduler thread\n";
+        schedule_thread_running = true;
+    }
+    schedule = steps;
+    ScheduleStartStep(0);
+    PIN_SemaphoreSet(&schedulewake);
+    ss << "schedule started, " << steps.size() << " steps, now " << modetostring(m) << std::endl;
+    return ss.str();
+}
+
+std::string ScheduleCommand(const std::string& args)
+{
+    PIN_GetLock(&schedulelock, PIN_ThreadId() + 1);
+    const std::string result = ScheduleCommandLocked(args);
+    PIN_ReleaseLock(&schedulelock);
+    return result;
+}
+
+template<typename Stream>
+void write_to_file(Stream& ss)
+{
+    PrintData(ss);
+    ss << "------------------\n";
+    ss << std::flush;
+}
+
+/*
+* Binary dump (dump -b), see dumpformat.h.
+* Addresses are written relative to the module load address, names go through a string table
+* that only contains the modules and symbols of the dumped rows.
+*/
+void write_binary_dump(std::ofstream& file)
+{
+    std::vector<PrintRow> vec = CollectRows();
+    const bool blockrows = gran == granularity::BBL;
+    std::sort(vec.begin(), vec.end(), [](const PrintRow &a, const PrintRow &b) { return a.order < b.order; });
+
+    DumpStringTable strings;
+    std::vector<DumpRow> rows;
+    rows.reserve(vec.size());
+    for(size_t i = 0; i < vec.size(); i++)
+    {
+        const PrintRow& x = vec[i];
+        const UINT32 rtn = blockrows ? blocks.routine(x.id) : x.id;
+        const ADDRINT adr = blockrows ? blocks.address(x.id) : routines.address(rtn);
+        DumpRow r{};
+        r.rva = adr - routines.imagedata(routines.colddata(rtn).image).low;
+        r.count = x.count;
+        r.module = strings.intern(routines.image(rtn));
+        r.symbol = strings.intern(blockrows ? BlockSymbol(x.id) : routines.name(rtn));
+        r.order = (UINT32)i;
+        rows.push_back(r);
+    }
+    WriteDump(file, rows, strings, blockrows ? DUMP_FLAG_BLOCKS : 0);
+}
+
+/*
+* Binary event log (-b).
+* Every hit is pushed as a fixed size record into a ring owned by the thread, an internal
+* thread drains all rings to disk in large writes. Routine names go to a separate <file>.sym
+* text file, appended as routines show up in the trace.
+* The ring of an exited thread is drained one last time and then handed to the next new thread.
+* Only routine entries are recorded, so the log is not available in bbl granularity.
+*/
+const size_t TRACE_DRAIN_RECORDS = 1 << 16;
+const UINT32 TRACE_DRAIN_INTERVAL_MS = 10;
+
+std::ofstream traceFile;
+std::ofstream traceSymFile;
+std::vector<TraceRing*> tracerings; //rings of live threads and closed ones not drained yet
+std::vector<TraceRing*> freerings;  //drained rings of exited threads
+UINT64 trace_dropped = 0;           //dropped records of the rings in freerings
+PIN_LOCK tracelock;
+REG tracereg = REG_INVALID();
+PIN_THREAD_UID trace_thread_uid = 0;
+volatile bool trace_stop = false;
+std::vector<bool> trace_named; //routines whose name is in the symbol file, drain thread only
+
+bool tracing() { return traceFile.is_open(); }
+
+//writes the names of routines that occur in the trace for the first time
+void TraceWriteSymbols(const TraceRecord* records, size_t n)
+{
+    for(size_t i = 0; i < n; i++)
+    {
+        const UINT32 id = records[i].routine;
+        if(id >= trace_named.size())
+            trace_named.resize(id + 1);
+        else if(trace_named[id])
+            continue;
+        trace_named[id] = true;
+        traceSymFile << id << "\t" << tohex(routines.address(id)) << "\t" << routines.image(id) << "\t" << routines.resolve(id) << "\n";
+    }
+}
+
+//drains all rings once, returns the number of records written
+size_t TraceDrain(std::vector<TraceRecord>& buf)
+{
+    PIN_GetLock(&tracelock, PIN_ThreadId() + 1);
+    const std::vector<TraceRing*> rings = tracerings;
+    PIN_ReleaseLock(&tracelock);
+
+    size_t total = 0;
+    std::vector<TraceRing*> drained; //closed before they were emptied, so nothing follows
+    for(TraceRing* ring : rings)
+    {
+        const bool closed = ring->isclosed();
+        size_t n;
+        while((n = ring->pop(buf.data(), buf.size())) > 0)
+        {
+            traceFile.write((const char*)buf.data(), n * sizeof(TraceRecord));
+            TraceWriteSymbols(buf.data(), n);
+            total += n;
+        }
+        if(closed)
+            drained.push_back(ring);
+    }
+    if(total)
+        traceSymFile.flush();
+
+    if(!drained.empty())
+    {
+        PIN_GetLock(&tracelock, PIN_ThreadId() + 1);
+        for(TraceRing* ring : drained)
+        {
+            trace_dropped += ring->droppedcount();
+            tracerings.erase(std::find(tracerings.begin(), tracerings.end(), ring));
+            freerings.push_back(ring);
+        }
+        PIN_ReleaseLock(&tracelock);
+    }
+    return total;
+}
+
+void trace_drain_thread(void* arg)
+{
+    std::vector<TraceRecord> buf(TRACE_DRAIN_RECORDS);
+    while(!trace_stop && !PIN_IsProcessExiting())
+    {
+        if(!TraceDrain(buf))
+            PIN_Sleep(TRACE_DRAIN_INTERVAL_MS);
+    }
+    TraceDrain(buf);
+    traceFile.flush();
+}
+
+bool TraceOpen(const std::string& path)
+{
+    traceFile.open(path.c_str(), std::ios::binary);
+    traceSymFile.open((path + ".sym").c_str());
+    if(!traceFile.is_open() || !traceSymFile.is_open())
+    {
+        traceFile.close();
+        traceSymFile.close();
+        return false;
+    }
+
+    TraceFileHeader header{};
+    std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordsize = sizeof(TraceRecord);
+    header.tscstart = ReadTsc();
+    traceFile.write((const char*)&header, sizeof(header));
+
+    THREADID thread_id = PIN_SpawnInternalThread(trace_drain_thread, NULL, 0, &trace_thread_uid);
+    if(thread_id == INVALID_THREADID)
+    {
+        traceFile.close();
+        traceSymFile.close();
+        return false;
+    }
+    return true;
+}
+
+void TraceThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    TraceRing* ring = nullptr;
+    PIN_GetLock(&tracelock, tid + 1);
+    if(!freerings.empty())
+    {
+        ring = freerings.back();
+        freerings.pop_back();
+        ring->reuse((UINT16)tid);
+    }
+    PIN_ReleaseLock(&tracelock);
+    if(!ring)
+        ring = new TraceRing((UINT16)tid);
+
+    PIN_GetLock(&tracelock, tid + 1);
+    tracerings.push_back(ring);
+    PIN_ReleaseLock(&tracelock);
+    PIN_SetContextReg(ctxt, tracereg, (ADDRINT)ring);
+}
+
+void TraceThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    TraceRing* ring = (TraceRing*)PIN_GetContextReg(ctxt, tracereg);
+    if(ring)
+        ring->close();
+}
+
+/*
+* Live stats region (-shm), see statsregion.h.
+* An internal thread copies the candidate rows into the shared segment every few ms while a
+* reader polls, so a watching controller costs the target nothing but that copy. Names are
+* appended to the string area once and their offsets cached per routine / block id, until the
+* image of the routine is unloaded (ids are reused when an image is loaded again).
+*/
+const UINT32 STATS_INTERVAL_MS = 50;
+
+StatsHeader* statsregion = nullptr;
+std::string statsname; //file backing the segment
+PIN_THREAD_UID stats_thread_uid = 0;
+volatile bool stats_stop = false;
+std::vector<UINT32> statsrtnname;   //string offset per routine id
+std::vector<UINT32> statsblockname; //string offset per block id
+std::vector<UINT32> statsimagename; //string offset per image
+
+//appends a name to the string area, returns its offset
+UINT32 StatsAddString(const std::string& str)
+{
+    StatsHeader* h = statsregion;
+    if(h->stringbytes + str.size() + 1 > h->stringcapacity)
+        return STATS_NO_STRING;
+    char* dest = (char*)h + h->stringsoffset + h->stringbytes;
+    std::memcpy(dest, str.c_str(), str.size() + 1);
+    const UINT32 offset = (UINT32)h->stringbytes;
+    h->stringbytes += str.size() + 1;
+    return offset;
+}
+
+//cached string offset, added on first use
+template<typename F>
+UINT32 StatsString(std::vector<UINT32>& cache, UINT32 id, F name)
+{
+    if(id >= cache.size())
+        cache.resize(id + 1024, STATS_NO_STRING);
+    if(cache[id] == STATS_NO_STRING)
+        cache[id] = StatsAddString(name());
+    return cache[id];
+}
+
+void StatsPublish()
+{
+    StatsHeader* h = statsregion;
+    const bool blockrows = gran == granularity::BBL;
+    std::vector<PrintRow> vec = CollectRows();
+
+    h->seq.fetch_add(1, std::memory_order_acq_rel); //odd, readers retry
+    std::atomic_thread_fence(std::memory_order_release);
+
+    DumpRow* rows = (DumpRow*)((char*)h + h->rowsoffset);
+    const size_t n = std::min<size_t>(vec.size(), h->rowcapacity);
+    for(size_t i = 0; i < n; i++)
+    {
+        const PrintRow& x = vec[i];
+        const UINT32 rtn = blockrows ? blocks.routine(x.id) : x.id;
+        const UINT32 image = routines.colddata(rtn).image;
+        DumpRow& r = rows[i];
+        r.rva = (blockrows ? blocks.address(x.id) : routines.address(rtn)) - routines.imagedata(image).low;
+        r.count = x.count;
+        r.module = StatsString(statsimagename, image, [image]() { return routines.imagename(image); });
+        if(blockrows)
+            r.symbol = StatsString(statsblockname, x.id, [&x]() { return BlockSymbol(x.id); });
+        else
+            r.symbol = StatsString(statsrtnname, rtn, [rtn]() { return routines.name(rtn); });
+        r.order = x.order;
+        r.reserved = 0;
+    }
+    h->rows = n;
+    h->candidates = vec.size();
+    h->flags = blockrows ? DUMP_FLAG_BLOCKS : 0;
+    h->mode = (UINT32)m;
+    h->updates++;
+
+    h->seq.fetch_add(1, std::memory_order_release); //even again
+}
+
+//cached names of an unloaded image are dropped, another routine may get the id later
+void StatsForgetImage(ADDRINT low, ADDRINT high)
+{
+    if(!statsregion)
+        return;
+    for(size_t id = 0; id < statsrtnname.size() && id < routines.size(); id++)
+        if(routines.address((UINT32)id) >= low && routines.address((UINT32)id) <= high)
+            statsrtnname[id] = STATS_NO_STRING;
+    for(size_t id = 0; id < statsblockname.size() && id < blocks.size(); id++)
+        if(blocks.address((UINT32)id) >= low && blocks.address((UINT32)id) <= high)
+            statsblockname[id] = STATS_NO_STRING;
+}
+
+void stats_thread(void* arg)
+{
+    UINT64 polls = 0;
+    while(!stats_stop && !PIN_IsProcessExiting())
+    {
+        //only when a reader polled since the last update
+        const UINT64 p = statsregion->readerpolls.load(std::memory_order_acquire);
+        if(p != polls)
+        {
+            polls = p;
+            //image loads and jitting add routines and blocks
+            PIN_LockClient();
+            StatsPublish();
+            PIN_UnlockClient();
+        }
+        PIN_Sleep(STATS_INTERVAL_MS);
+    }
+}
+
+bool StatsOpen(const std::string& name)
+{
+#ifdef _WIN32
+    return false;
+#else
+    //shm_open() is not part of pin's CRT, on linux a segment is just a file in /dev/shm
+    const size_t start = name.find_first_not_of('/');
+    if(start == std::string::npos)
+        return false;
+    statsname = "/dev/shm/" + name.substr(start);
+    const int fd = open(statsname.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if(fd < 0)
+        return false;
+    const uint64_t size = StatsRegionSize();
+    void* p = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(p == MAP_FAILED)
+    {
+        unlink(statsname.c_str());
+        return false;
+    }
+
+    StatsHeader* h = (StatsHeader*)p;
+    h->rowcapacity = STATS_ROW_CAPACITY;
+    h->stringcapacity = STATS_STRING_CAPACITY;
+    h->rowsoffset = sizeof(StatsHeader);
+    h->stringsoffset = h->rowsoffset + STATS_ROW_CAPACITY * sizeof(DumpRow);
+    h->version = STATS_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(h->magic, STATS_MAGIC, sizeof(h->magic)); //readers check the magic first
+    statsregion = h;
+
+    THREADID thread_id = PIN_SpawnInternalThread(stats_thread, NULL, 0, &stats_thread_uid);
+    if(thread_id == INVALID_THREADID)
+    {
+        unlink(statsname.c_str());
+        statsregion = nullptr;
+        return false;
+    }
+    return true;
+#endif
+}
+
+//stop the stats thread, the segment is removed so stale data is not watched
+void StatsClose()
+{
+    if(!statsregion)
+        return;
+    stats_stop = true;
+    PIN_WaitForThreadTermination(stats_thread_uid, PIN_INFINITE_TIMEOUT, NULL);
+#ifndef _WIN32
+    unlink(statsname.c_str());
+#endif
+}
+
+//stop the internal threads before pin tears down the process
+void PrepareForFini(void *v)
+{
+    StatsClose();
+    if(!tracing())
+        return;
+    trace_stop = true;
+    PIN_WaitForThreadTermination(trace_thread_uid, PIN_INFINITE_TIMEOUT, NULL);
+
+    UINT64 dropped = trace_dropped;
+    for(TraceRing* ring : tracerings)
+        dropped += ring->droppedcount();
+    outFile << "trace records dropped: " << dropped << std::endl;
+    traceFile.close();
+    traceSymFile.close();
+}
+
+void Fini(INT32 code, void *v)
+{
+    write_to_file(outFile);
+    outFile.close();
+}
+
+/*
+* Probe mode.
+* Probes are inserted once at image load and can not be re-jitted, so the single analysis
+* routine checks mode and filter at run time.
+*/
+std::vector<UINT32> unprobed;
+
+CounterShard* ProbeShard()
+{
+    const THREADID tid = PIN_ThreadId();
+    const UINT32 slot = tid < MAX_SHARDS ? tid : MAX_SHARDS - 1;
+    CounterShard* shard = probeshards[slot];
+    if(shard)
+        return shard;
+
+    PIN_GetLock(&probelock, tid + 1);
+    if(!probeshards[slot])
+        probeshards[slot] = rtnshards.create(tid);
+    shard = probeshards[slot];
+    PIN_ReleaseLock(&probelock);
+    return shard;
+}
+
+void ProbeHit(UINT32 id)
+{
+    if(request_detach)
+    {
+        request_detach = false;
+        PIN_DetachProbed();
+        return;
+    }
+    if(m == mode::OFF || (routines.hotdata(id).flags & (RTN_FLAG_FILTERED | RTN_FLAG_RETIRED)))
+        return;
+    if(m == mode::TRIM)
+    {
+        //like the jit path, only a candidate walks the shards, later hits find it trimmed
+        if(routines.presence.test(id))
+            TrimCount(id);
+        return;
+    }
+    UINT64 *firsthit = &routines.hotdata(id).firsthit;
+    if((UINT32)(*firsthit >> 32) != hitwindow)
+    {
+        routines.presence.set(id);
+        StampFirstHit(firsthit, hitwindow);
+    }
+    ProbeShard()->at(id)++;
+}
+
+void InsertProbe(RTN rtn, UINT32 id)
+{
+    if(RTN_IsSafeForProbedInsertion(rtn) && RTN_InsertCallProbed(rtn, IPOINT_BEFORE, (AFUNPTR)ProbeHit, IARG_UINT32, id, IARG_END))
+        return;
+
+    unprobed.push_back(id);
+    dbgLog << "cannot probe: " << tohex(routines.address(id)) << " " << routines.image(id) << " " << routines.name(id) << std::endl;
+}
+
+/*
+* Symbol cache (-symcache).
+* The routines of an image are written to the cache directory on its first load. Later runs
+* register them straight from the mmapped cache file instead of walking every RTN of the image
+* and copying its name. Probes need the RTN handles, so probe mode only writes the cache.
+*/
+std::string symcachedir;
+
+std::string SymCachePath(const std::string& filename, const std::string& key)
+{
+    return symcachedir + "/" + filename + "." + key + ".fsym";
+}
+
+//an image registered from its cache file, which stays mapped until the image is unloaded
+struct CachedImage
+{
+    SymCacheView view;
+    UINT32 firstid = 0;
+    std::vector<UINT32> rows; //row of routine firstid + i
+};
+
+std::map<UINT32, CachedImage*> cachedimages; //by image, guarded by the client lock
+
+//registers the routines of an image from its cache file, false if there is no valid cache for the image
+bool LoadCachedRoutines(UINT32 image, ADDRINT low, const std::string& path, const std::string& key)
+{
+    CachedImage* cached = new CachedImage;
+    SymCacheView& cache = cached->view;
+    if(!cache.open(path, key))
+    {
+        delete cached;
+        return false;
+    }
+
+    const std::string& filename = routines.imagename(image);
+    cached->firstid = (UINT32)routines.size();
+    for(uint64_t i = 0; i < cache.rows(); i++)
+    {
+        const SymCacheRow& row = cache.row(i);
+        const UINT32 id = routines.add(low + row.rva, image);
+        if(id == RoutineTable::INVALID_ID)
+        {
+            dbgLog << "routine table full, ignored: " << tohex(low + row.rva) << " " << filename << std::endl;
+            break;
+        }
+        //new ids are handed out in order, known addresses keep their old id and are resolved by pin
+        if(id == cached->firstid + cached->rows.size())
+            cached->rows.push_back((UINT32)i);
+        if(dbgLog.is_open())
+            dbgLog << "hook routine: " << tohex(low + row.rva) << " " << filename << " " << cache.name(row) << std::endl;
+    }
+    cachedimages[image] = cached;
+    dbgLog << "symbol cache: " << cache.rows() << " routines from " << path << std::endl;
+    return true;
+}
+
+//looks up routine names on demand for the routine table
+std::string ResolveRoutineName(UINT32 id, ADDRINT address)
+{
+    PIN_LockClient(); //recursive, commands already hold it
+    std::string name;
+    auto it = cachedimages.find(routines.colddata(id).image);
+    if(it != cachedimages.end() && id >= it->second->firstid && id - it->second->firstid < it->second->rows.size())
+    {
+        const SymCacheView& cache = it->second->view;
+        name = cache.name(cache.row(it->second->rows[id - it->second->firstid]));
+    }
+    else
+    {
+        name = RTN_FindNameByAddress(address);
+    }
+    PIN_UnlockClient();
+    return name;
+}
+
+//registers the routines pin found in the image, and writes them to the symbol cache if cachepath is set
+void WalkRoutines(IMG img, UINT32 image, const std::string& cachepath, const std::string& key)
+{
+    const std::string& filename = routines.imagename(image);
+    const ADDRINT low = IMG_LowAddress(img);
+    SymCacheWriter cache;
+    for(SEC sec = IMG_SecHead(img); SEC_Valid(sec); sec = SEC_Next(sec))
+    {
+        for(RTN rtn = SEC_RtnHead(sec); RTN_Valid(rtn); rtn = RTN_Next(rtn))
+        {
+            const ADDRINT adr = RTN_Address(rtn);
+            const UINT32 id = routines.add(adr, image);
+            if(id == RoutineTable::INVALID_ID)
+            {
+                dbgLog << "routine table full, ignored: " << tohex(adr) << " " << filename << std::endl;
+                return;
+            }
+            if(!cachepath.empty())
+                cache.add(adr - low, (uint32_t)RTN_Size(rtn), RTN_Name(rtn));
+
+            //the actual instrumentation is done per mode in Trace(), unless probing
+            if(dbgLog.is_open())
+                dbgLog << "hook routine: " << tohex(adr) << " " << filename << " " << RTN_Name(rtn) << std::endl;
+            if(probemode)
+                InsertProbe(rtn, id);
+        }
+    }
+
+    if(!cachepath.empty() && !SymCacheView().open(cachepath, key))
+    {
+        if(cache.write(cachepath, key))
+            dbgLog << "symbol cache written: " << cachepath << std::endl;
+        else
+            dbgLog << "could not write symbol cache: " << cachepath << std::endl;
+    }
+}
+
+// Pin calls this function for every loaded image, all routines of the image are registered here
+void ImgLoad(IMG img, void *v)
+{
+    if(IMG_Valid(img) && IMG_IsMainExecutable(img))
+    {
+        LOG("Loaded main Image: " + IMG_Name(APP_ImgHead()) + "\n");
+        outFile << ("Loaded main Image: " + IMG_Name(APP_ImgHead()) + "\n");
+    }
+
+    const std::string filename = StripPath(IMG_Name(img).c_str());
+    const bool enabled = should_consider_module(filename);
+    const UINT32 image = routines.addimage(filename, IMG_Name(img), IMG_LowAddress(img), IMG_HighAddress(img), enabled);
+    routines.imagedata(image).samplelimit = SampleLimitFor(filename);
+    dbgLog << "image: " << filename << (enabled ? "" : " (filtered)") << std::endl;
+
+    const size_t first = routines.size();
+    const std::string key = symcachedir.empty() ? "" : ImageKey(image);
+    const std::string cachepath = key.empty() ? "" : SymCachePath(filename, key);
+    if(cachepath.empty() || probemode || !LoadCachedRoutines(image, IMG_LowAddress(img), cachepath, key))
+        WalkRoutines(img, image, cachepath, key);
+
+    if(session_restrict)
+        SessionImageLoaded(image, first);
+}
+
+// names of candidates can not be resolved once their image is gone, so they are kept
+// the symbol cache of the image is unmapped afterwards
+void ImgUnload(IMG img, void *v)
+{
+    const ADDRINT low = IMG_LowAddress(img);
+    const ADDRINT high = IMG_HighAddress(img);
+    routines.presence.foreach(routines.size(), [low, high](UINT32 id) {
+        const ADDRINT adr = routines.address(id);
+        if(adr >= low && adr <= high)
+            routines.keepname(id);
+    });
+    blocks.presence.foreach(blocks.size(), [low, high](UINT32 id) {
+        if(blocks.address(id) >= low && blocks.address(id) <= high)
+            routines.keepname(blocks.routine(id));
+    });
+
+    StatsForgetImage(low, high);
+
+    for(auto it = cachedimages.begin(); it != cachedimages.end();)
+    {
+        if(routines.imagedata(it->first).low == low)
+        {
+            delete it->second;
+            it = cachedimages.erase(it);
+        }
+        else
+            ++it;
     }
-
-    return sent;
 }
 
+/*
+* Analysis routines.
+* Trace() only inserts the routines needed for the current mode, nothing at all when OFF.
+* The collect path is split into an If/Then pair that allocates (or lazily resets after clear)
+* the counter chunk on first use and a straight-line increment, both can be inlined by pin.
+*/
 
-//core functionality data
+ADDRINT PIN_FAST_ANALYSIS_CALL ShardChunkStale(CounterShard *shard, UINT32 chunk)
+{
+    return shard->gens[chunk] != *shard->generation;
+}
 
-struct RtnInfo
+void PIN_FAST_ANALYSIS_CALL ShardChunkRefresh(CounterShard *shard, UINT32 chunk)
 {
-    std::string name;
-    std::string image;
-    ADDRINT address = 0;
-    UINT64 rtnCount = 0;
-    size_t order = 0;
-};
+    shard->refresh(chunk);
+}
 
-//global counter/order of hooked routines
-size_t globalorder = 1;
+void PIN_FAST_ANALYSIS_CALL CountHit(CounterShard *shard, UINT32 chunk, UINT32 offset)
+{
+    shard->chunks[chunk][offset]++;
+}
 
-//sort results chronological (true) or by hitcount (false)
-bool sortbychrono = false;
+//false again once the routine is saturated, until its instrumentation is flushed
+ADDRINT PIN_FAST_ANALYSIS_CALL ReachedLimit(CounterShard *shard, UINT32 chunk, UINT32 offset, UINT32 limit, UINT32 *flags)
+{
+    return (shard->chunks[chunk][offset] >= limit) & !(*flags & RTN_FLAG_SATURATED);
+}
 
-//detach from the target as soon as possible
-bool request_detach = false;
+void SaturateHit(UINT32 id, THREADID tid)
+{
+    RetireRoutine(id, tid, RTN_FLAG_SATURATED);
+}
 
-//map of all hooked routines
-std::map<ADDRINT, RtnInfo> routines;
+void PIN_FAST_ANALYSIS_CALL TrimHit(UINT32 id)
+{
+    TrimCount(id);
+}
 
-//module blacklist+whitelist
-std::set<std::string> mod_white;
-std::set<std::string> mod_black;
+ADDRINT PIN_FAST_ANALYSIS_CALL NotRetired(UINT32 *flags)
+{
+    return !(*flags & RTN_FLAG_RETIRED);
+}
 
-//returns false if the module should be ignored due to blacklist/whitelist
-bool should_consider_module(const std::string &str)
+void PIN_FAST_ANALYSIS_CALL TrimRetireHit(UINT32 id, THREADID tid)
 {
-    if(mod_white.size())
-        return mod_white.count(str);
-    if(mod_black.size())
-        return !mod_black.count(str);
-    return true; // both lists empty
+    TrimCount(id);
+    RetireRoutine(id, tid);
 }
 
-//controls whether we add or remove to/from our dataset
-enum class mode
+void TraceHit(TraceRing *ring, UINT32 id, UINT32 kind)
 {
-    OFF,        //freeze current data
-    COLLECT,    //add executing functions to data
-    TRIM,       //remove executing functions from data
-};
-mode m = mode::OFF;
-std::string modetostring(mode mm)
+    ring->push(id, (UINT8)kind);
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL NotPresent(UINT64 *word, ADDRINT mask)
 {
-    if(mm == mode::OFF)
-        return "OFF";
-    if(mm == mode::COLLECT)
-        return "COLLECT";
-    if(mm == mode::TRIM)
-        return "TRIM";
-    return "???";
+    return !(*word & mask);
 }
 
+ADDRINT PIN_FAST_ANALYSIS_CALL IsPresent(UINT64 *word, ADDRINT mask)
+{
+    return *word & mask;
+}
 
-/*
-Now some related functions.
-*/
+void PIN_FAST_ANALYSIS_CALL SetPresent(PresenceBitmap *presence, UINT32 id)
+{
+    presence->set(id);
+}
 
-template<typename Stream>
-void PrintData(Stream& ss, size_t n = INT32_MAX)
+ADDRINT PIN_FAST_ANALYSIS_CALL NotHitInWindow(UINT64 *firsthit)
+{
+    return (UINT32)(*firsthit >> 32) != hitwindow;
+}
+
+void PIN_FAST_ANALYSIS_CALL FirstHit(UINT64 *firsthit, UINT32 id)
 {
-    //std::copy_if(routines.begin(), routines.end(), std::back_inserter(vec), [](const auto& x) { return x.second.rtnCount  != 0; });
-    std::vector<RtnInfo> vec;
-    for(const auto &x : routines)
-        if(x.second.rtnCount)
-            vec.push_back(x.second);
+    routines.presence.set(id);
+    StampFirstHit(firsthit, hitwindow);
+}
 
-    std::sort(vec.begin(), vec.end(), [](const auto &a, const auto &b) { return a.order < b.order; });
-    std::for_each(vec.begin(), vec.end(), [i=size_t(0)](auto& x) mutable { x.order = i++; });
-    if(!sortbychrono)
-        std::sort(vec.begin(), vec.end(), [](const auto& a, const auto& b) { return a.rtnCount > b.rtnCount; });
+void PIN_FAST_ANALYSIS_CALL BlockTrimHit(UINT32 id)
+{
+    blocks.presence.clear(id);
+    blockshards.trim(id);
+}
 
-    const int ww[]{NumDigits((int)vec.size()), 18, 10, 20, 0};
-    print_aligned(ss, ww, "#", "Address", "Hits", "Module", "Symbol");
+void PIN_FAST_ANALYSIS_CALL ZoomBlockHit(volatile INT64 *counter)
+{
+    atomic_add64(counter, 1);
+}
 
-    size_t lim = 0;
-    for(const auto& x : vec)
-    {
-        print_aligned(ss, ww, x.order, tohex(x.address), x.rtnCount, x.image, x.name);
-        if(lim++ > n)
-        {
-            ss << "<...>\n";
-            break;
-        }
-    }
-    ss << "Total Count: " << std::dec << vec.size() << std::endl;
+void ZoomEnter(ZoomRoutine *z, ADDRINT ret)
+{
+    atomic_add64(&z->calls, 1);
+    z->callsites.hit(ret);
 }
 
-std::string PrintData(size_t n = INT32_MAX)
+void ZoomArgs(ZoomRoutine *z, UINT32 n, ADDRINT a0, ADDRINT a1, ADDRINT a2, ADDRINT a3, ADDRINT a4, ADDRINT a5)
 {
-    std::stringstream ss;
-    PrintData(ss, n);
-    return ss.str();
+    const ADDRINT args[ZOOM_MAX_ARGS] = { a0, a1, a2, a3, a4, a5 };
+    z->record_args(args, n);
 }
 
-void ClearData()
+void DetachHit()
 {
-    routines.clear();
+    if(request_detach)
+    {
+        request_detach = false;
+        PIN_Detach();
+    }
 }
 
-template<typename Stream>
-void write_to_file(Stream& ss)
+// Used instead of the specialized routines when the debug log (-d) is enabled
+void docount_dbg(UINT32 id, CounterShard *shard)
 {
-    PrintData(ss);
-    ss << "------------------\n";
-    ss << std::flush;
+    if(m == mode::OFF)
+    {
+        dbgLog << "ignored: " << tohex(routines.address(id)) << " " << routines.image(id) << " " << routines.name(id) << std::endl;
+        return;
+    }
+    if(m == mode::TRIM)
+    {
+        TrimCount(id);
+        dbgLog << "trimmed: " << tohex(routines.address(id)) << " " << routines.image(id) << " " << routines.name(id) << std::endl;
+        return;
+    }
+    if(m == mode::COLLECT)
+    {
+        routines.presence.set(id);
+        StampFirstHit(&routines.hotdata(id).firsthit, hitwindow);
+        shard->at(id)++;
+        dbgLog << "collect: " << tohex(routines.address(id)) << " " << routines.image(id) << " " << routines.name(id) << std::endl;
+        return;
+    }
 }
 
-void Fini(INT32 code, void *v)
+//marks the id present on its first hit and counts it in the shard of the thread
+//routines also record the first hit order of the window, in the same rarely taken branch
+void InsertCountCall(INS ins, PresenceBitmap &presence, REG reg, UINT32 id, UINT64 *firsthit = nullptr)
 {
-    write_to_file(outFile);
-    outFile.close();
+    if(firsthit)
+    {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)NotHitInWindow, IARG_FAST_ANALYSIS_CALL, IARG_PTR, firsthit, IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)FirstHit, IARG_FAST_ANALYSIS_CALL, IARG_PTR, firsthit, IARG_UINT32, id, IARG_END);
+    }
+    else
+    {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)NotPresent, IARG_FAST_ANALYSIS_CALL, IARG_PTR, presence.word(id), IARG_ADDRINT, (ADDRINT)PresenceBitmap::mask(id), IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)SetPresent, IARG_FAST_ANALYSIS_CALL, IARG_PTR, &presence, IARG_UINT32, id, IARG_END);
+    }
+
+    const UINT32 chunk = id >> SHARD_CHUNK_BITS;
+    const UINT32 offset = id & (SHARD_CHUNK_SIZE - 1);
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)ShardChunkStale, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg, IARG_UINT32, chunk, IARG_END);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)ShardChunkRefresh, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg, IARG_UINT32, chunk, IARG_END);
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)CountHit, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg, IARG_UINT32, chunk, IARG_UINT32, offset, IARG_END);
 }
 
-void ImgLoad(IMG img, void *v)
+void InsertBlockCall(INS ins, UINT32 id)
 {
-    if(IMG_Valid(img) && IMG_IsMainExecutable(img))
+    if(m == mode::COLLECT)
     {
-        LOG("Loaded main Image: " + IMG_Name(APP_ImgHead()) + "\n");
-        outFile << ("Loaded main Image: " + IMG_Name(APP_ImgHead()) + "\n");
+        InsertCountCall(ins, blocks.presence, blockshards.reg, id);
+    }
+    else if(m == mode::TRIM)
+    {
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsPresent, IARG_FAST_ANALYSIS_CALL, IARG_PTR, blocks.presence.word(id), IARG_ADDRINT, (ADDRINT)PresenceBitmap::mask(id), IARG_END);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)BlockTrimHit, IARG_FAST_ANALYSIS_CALL, IARG_UINT32, id, IARG_END);
     }
 }
 
-// This function is called before every hooked routine is executed
-void docount(RtnInfo *rt)
+void InsertHitCall(INS ins, UINT32 id)
 {
     if(request_detach)
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)DetachHit, IARG_END);
+
+    if(tracing())
     {
-        request_detach = false;
-        PIN_Detach();
-        return;
+        const UINT32 kind = m == mode::COLLECT ? TRACE_COLLECT : m == mode::TRIM ? TRACE_TRIM : TRACE_IGNORED;
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)TraceHit, IARG_REG_VALUE, tracereg, IARG_UINT32, id, IARG_UINT32, kind, IARG_END);
     }
-    if(m == mode::OFF)
+
+    if(dbgLog.is_open())
     {
-        dbgLog << "ignored: " << tohex(rt->address) << " " << rt->image << " " << rt->name << std::endl;
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount_dbg, IARG_UINT32, id, IARG_REG_VALUE, rtnshards.reg, IARG_END);
         return;
     }
-    if(m == mode::TRIM)
+
+    if(m == mode::COLLECT)
     {
-        if(should_consider_module(rt->image))
+        InsertCountCall(ins, routines.presence, rtnshards.reg, id, &routines.hotdata(id).firsthit);
+        const UINT32 limit = SampleLimit(id);
+        if(limit)
         {
-            rt->rtnCount = 0;
-            dbgLog << "trimmed: " << tohex(rt->address) << " " << rt->image << " " << rt->name << std::endl;
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)ReachedLimit, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, rtnshards.reg,
+                             IARG_UINT32, id >> SHARD_CHUNK_BITS, IARG_UINT32, id & (SHARD_CHUNK_SIZE - 1), IARG_UINT32, limit,
+                             IARG_PTR, &routines.hotdata(id).flags, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)SaturateHit, IARG_UINT32, id, IARG_THREAD_ID, IARG_END);
         }
-        return;
     }
-    if(m == mode::COLLECT)
+    else if(m == mode::TRIM)
     {
-        if(should_consider_module(rt->image))
+        if(retire_on_trim)
         {
-            rt->rtnCount++;
-            dbgLog << "collect: " << tohex(rt->address) << " " << rt->image << " " << rt->name << std::endl;
+            //once retired, the routine only costs this test until its instrumentation is flushed
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)NotRetired, IARG_FAST_ANALYSIS_CALL, IARG_PTR, &routines.hotdata(id).flags, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)TrimRetireHit, IARG_FAST_ANALYSIS_CALL, IARG_UINT32, id, IARG_THREAD_ID, IARG_END);
+        }
+        else
+        {
+            //only the first hit of a candidate walks the shards, later hits find its presence bit cleared
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsPresent, IARG_FAST_ANALYSIS_CALL, IARG_PTR, routines.presence.word(id), IARG_ADDRINT, (ADDRINT)PresenceBitmap::mask(id), IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)TrimHit, IARG_FAST_ANALYSIS_CALL, IARG_UINT32, id, IARG_END);
         }
-        return;
     }
 }
 
-// Pin calls this function every time a new rtn is executed
-void Routine(RTN rtn, void *v)
+//bbl granularity: every block of the trace is counted
+void TraceBlocks(TRACE trace)
 {
-    std::string filename = StripPath(IMG_Name(SEC_Img(RTN_Sec(rtn))).c_str());
-    ADDRINT adr = RTN_Address(rtn);
+    RTN rtn = TRACE_Rtn(trace);
+    if(!RTN_Valid(rtn))
+        return;
+
+    const UINT32 rid = routines.find(RTN_Address(rtn));
+    if(rid == RoutineTable::INVALID_ID || (routines.hotdata(rid).flags & RTN_FLAG_FILTERED))
+        return;
 
-    if(should_consider_module(filename)) //todo: this means we cant dynamically change whitelist/blacklist even though we calaim to support it!
+    for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
     {
-        RtnInfo &rc = routines[adr];
+        const UINT32 id = blocks.add(BBL_Address(bbl), rid);
+        if(id == BlockTable::INVALID_ID)
+        {
+            dbgLog << "block table full, ignored: " << tohex(BBL_Address(bbl)) << std::endl;
+            return;
+        }
+        InsertBlockCall(BBL_InsHead(bbl), id);
+    }
+}
 
-        rc.name = RTN_Name(rtn);
-        rc.image = filename;
-        rc.address = adr;
-        rc.rtnCount = 0;
-        rc.order = globalorder++;
+//zoom: only the zoomed routines are instrumented, every block of them is counted
+void ZoomTrace(TRACE trace)
+{
+    RTN rtn = TRACE_Rtn(trace);
+    if(!RTN_Valid(rtn))
+        return;
 
-        dbgLog << "hook routine: " << tohex(rc.address) << " " << rc.image << " " << rc.name << std::endl;
-        RTN_Open(rtn);
+    const ADDRINT adr = RTN_Address(rtn);
+    const UINT32 id = routines.find(adr);
+    auto it = zoomed.find(id);
+    if(it == zoomed.end() || (routines.hotdata(id).flags & (RTN_FLAG_RETIRED | RTN_FLAG_FILTERED)))
+        return;
+    ZoomRoutine* z = it->second;
 
-        // Insert a call at the entry point of a routine to increment the call count
-        RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)docount, IARG_PTR, &rc, IARG_END);
+    for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        INS_InsertCall(BBL_InsHead(bbl), IPOINT_BEFORE, (AFUNPTR)ZoomBlockHit, IARG_FAST_ANALYSIS_CALL, IARG_PTR, z->block(BBL_Address(bbl)), IARG_END);
+        if(gran == granularity::BBL)
+        {
+            const UINT32 bid = blocks.add(BBL_Address(bbl), id);
+            if(bid != BlockTable::INVALID_ID)
+                InsertBlockCall(BBL_InsHead(bbl), bid);
+        }
 
-        // For each instruction of the routine
-        // for(INS ins = RTN_InsHead(rtn); INS_Valid(ins); ins = INS_Next(ins))
-        //{
-        //    // Insert a call to docount to increment the instruction counter for this rtn
-        //    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_PTR, &(rc->_icount), IARG_END);
-        //}
+        for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+            if(INS_Address(ins) != adr)
+                continue;
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ZoomEnter, IARG_PTR, z, IARG_RETURN_IP, IARG_END);
+            if(zoomargs)
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ZoomArgs, IARG_PTR, z, IARG_UINT32, zoomargs,
+                               IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_FUNCARG_ENTRYPOINT_VALUE, 1, IARG_FUNCARG_ENTRYPOINT_VALUE, 2,
+                               IARG_FUNCARG_ENTRYPOINT_VALUE, 3, IARG_FUNCARG_ENTRYPOINT_VALUE, 4, IARG_FUNCARG_ENTRYPOINT_VALUE, 5, IARG_END);
+            if(gran == granularity::RTN && !(routines.hotdata(id).flags & RTN_FLAG_SATURATED))
+                InsertHitCall(ins, id);
+        }
+    }
+}
 
-        RTN_Close(rtn);
+// Pin calls this function every time a new trace is jitted, again after every mode change
+void Trace(TRACE trace, void *v)
+{
+    if(!zoomed.empty() && !request_detach)
+    {
+        ZoomTrace(trace);
+        return;
     }
-    else
+
+    if(gran == granularity::BBL && m != mode::OFF && !request_detach)
     {
-        dbgLog << "ignored module: " << tohex(adr) << " " << filename << std::endl;
+        TraceBlocks(trace);
+        return;
     }
-}
 
+    if(m == mode::OFF && !request_detach && !dbgLog.is_open() && !tracing())
+        return;
+
+    RTN rtn = TRACE_Rtn(trace);
+    if(!RTN_Valid(rtn))
+        return;
+
+    const ADDRINT adr = RTN_Address(rtn);
+    if(adr < TRACE_Address(trace) || adr >= TRACE_Address(trace) + TRACE_Size(trace))
+        return; //routine entry is not part of this trace
+
+    const UINT32 id = routines.find(adr);
+    if(id == RoutineTable::INVALID_ID || (routines.hotdata(id).flags & (RTN_FLAG_RETIRED | RTN_FLAG_FILTERED | RTN_FLAG_SATURATED)))
+        return;
 
+    for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+            if(INS_Address(ins) == adr)
+            {
+                InsertHitCall(ins, id);
+                return;
+            }
+        }
+    }
+}
 
 bool execute_string_cmd(const std::string& cmd, std::string* result)
 {
@@ -332,13 +2643,47 @@ bool execute_string_cmd(const std::string& cmd, std::string* result)
         result->append("unfreeze      -- unfreeze the target program.\n");
         result->append("clear         -- clear all collected data.\n");
         result->append("show          -- show stats on collected data.\n");
+        result->append("show <query>  -- show entries matching all terms, e.g. show module=foo hits>=3\n");
+        result->append("                 terms: hits=6 hits=6..12 hits>=3 hits<3 module=<mod> symbol=<substr> limit=<rows>\n");
+        result->append("histogram     -- number of functions per hit count.\n");
+        result->append("stats         -- how long the target was stopped, per command.\n");
         result->append("dump <file>   -- dump current data to file.\n");
+        result->append("dump -b <file> -- dump current data in binary form, compare dumps with findspot-diff.\n");
         result->append("mode collect  -- collect all functions called from now on.\n");
         result->append("mode trim     -- remove all functions called from now on.\n");
         result->append("mode off      -- dont touch collected data.\n");
         result->append("mode          -- show current mode.\n");
-        result->append("sort chrono   -- sort output in the order the functions were encountered.\n");
+        result->append("retire on     -- stop instrumenting trimmed functions (until clear).\n");
+        result->append("retire off    -- keep instrumenting trimmed functions.\n");
+        result->append("sample <n>    -- count only the first n hits per function and collect window (0 = all).\n");
+        result->append("sample <n> <mod> -- same, for one module only.\n");
+        result->append("sample off    -- count all hits in all modules.\n");
+        result->append("sample        -- show sample limits.\n");
+        result->append("granularity rtn -- count function entries (default).\n");
+        result->append("granularity bbl -- count basic blocks instead of functions.\n");
+        result->append("granularity   -- show current granularity.\n");
+        result->append("sort chrono   -- sort output in the order the functions were first executed in the collect window.\n");
+        result->append("                 in bbl granularity: the order the blocks were first jitted.\n");
         result->append("sort hitcount -- sort output by number of times the functions were encountered.\n");
+        result->append("probes        -- list functions that could not be probed (-probe only).\n");
+        result->append("snapshot save <name>   -- save the current data set.\n");
+        result->append("snapshot combine <name> = <a> & <b> -- functions in both a and b (lower count).\n");
+        result->append("snapshot combine <name> = <a> | <b> -- functions in a or b (counts added).\n");
+        result->append("snapshot combine <name> = <a> - <b> -- functions in a but not in b.\n");
+        result->append("snapshot show <name>   -- show a snapshot.\n");
+        result->append("snapshot load <name>   -- replace the current data set with a snapshot.\n");
+        result->append("snapshot delete <name> -- delete a snapshot.\n");
+        result->append("snapshot list -- list all snapshots.\n");
+        result->append("session save <file> -- save the candidates, relative to their modules.\n");
+        result->append("session load <file> -- restore saved candidates, also in a new run. only they stay instrumented.\n");
+        result->append("zoom          -- instrument only the candidates, with block counts and call sites.\n");
+        result->append("zoom args <n> -- same, also record the last values of the first n (max 6) argument registers.\n");
+        result->append("zoom show [rows] -- show the details of the zoomed functions.\n");
+        result->append("zoom off      -- instrument all functions again.\n");
+        result->append("schedule <step>; <step>; ... -- timed mode changes, e.g. schedule collect 3s; trim 60s; off\n");
+        result->append("                 steps: <mode> [<n>ms|<n>s|<n>m] [until candidates<=N|candidates>=N]\n");
+        result->append("schedule      -- show the running schedule.\n");
+        result->append("schedule cancel -- stop the schedule, the mode stays.\n");
         result->append("mod           -- display white/blacklist.\n");
         result->append("mod blacklist <mod> -- add module to blacklist.\n");
         result->append("mod whitelist <mod> -- add module to whitelist.\n");
@@ -350,6 +2695,8 @@ bool execute_string_cmd(const std::string& cmd, std::string* result)
     {
         //PIN_Detach();
         request_detach = true;
+        if(!probemode)
+            PIN_RemoveInstrumentation(); //every routine entry checks for the request from now on
         *result = "detach request registered\n";
         return true;
     }
@@ -358,6 +2705,45 @@ bool execute_string_cmd(const std::string& cmd, std::string* result)
         *result = PrintData(20);
         return true;
     }
+    else if(cmd.find("show ") == 0)
+    {
+        Query q;
+        if(ParseQuery(cmd.substr(std::strlen("show ")), &q, result))
+            *result = RunQuery(q);
+        return true;
+    }
+    else if(cmd == "stats")
+    {
+        std::stringstream ss;
+        const int ww[]{12, 10, 12, 12};
+        print_aligned(ss, ww, "Command", "Stops", "Total ms", "Max ms");
+        for(const auto& x : stopstats)
+            print_aligned(ss, ww, x.first, x.second.count, x.second.total, x.second.max);
+        *result = ss.str();
+        return true;
+    }
+    else if(cmd == "histogram")
+    {
+        *result = Histogram();
+        return true;
+    }
+    else if(cmd == "probes")
+    {
+        if(!probemode)
+        {
+            *result = "not in probe mode\n";
+            return true;
+        }
+        PIN_LockClient();
+        const std::vector<UINT32> ids = unprobed;
+        PIN_UnlockClient();
+        std::stringstream ss;
+        for(UINT32 id : ids)
+            ss << tohex(routines.address(id)) << " " << routines.image(id) << " " << routines.name(id) << "\n";
+        ss << ids.size() << " of " << routines.size() << " functions could not be probed" << std::endl;
+        *result = ss.str();
+        return true;
+    }
     else if(cmd == "mode")
     {
         *result = "current mode: " + modetostring(m) + "\n";
@@ -366,35 +2752,147 @@ bool execute_string_cmd(const std::string& cmd, std::string* result)
     else if(cmd.find("dump") == 0)
     {
         std::string path = TrimWhitespace(cmd.substr(std::strlen("dump")));
+        const bool binary = path == "-b" || path.find("-b ") == 0;
+        if(binary)
+            path = TrimWhitespace(path.substr(std::strlen("-b")));
+        if(path.empty())
+        {
+            *result = "usage: dump <file> or dump -b <file>\n";
+            return true;
+        }
         std::ofstream file;
-        file.open(path.c_str());
+        file.open(path.c_str(), binary ? std::ios::out | std::ios::binary : std::ios::out);
         if(!file.is_open())
-            std::cout << "Could not open file " << path << std::endl;
+            *result = "could not open file " + path + "\n";
+        else if(binary)
+            write_binary_dump(file);
         else
             write_to_file(file);
         return true;
     }
     else if(cmd == "clear")
     {
-        ClearData(); //todo broke because we pass pointers to contained data to instrumentation...
+        ClearData();
         *result = PrintData(20);
         return true;
     }
-    else if(cmd == "mode collect")
+    else if(probemode && (cmd.find("retire") == 0 || cmd.find("sample") == 0))
     {
-        m = mode::COLLECT;
-        *result = "new mode: " + modetostring(m) + "\n";
+        *result = "not available in probe mode\n";
         return true;
     }
-    else if(cmd == "mode trim")
+    else if(cmd == "retire on")
     {
-        m = mode::TRIM;
-        *result = "new mode: " + modetostring(m) + "\n";
+        retire_on_trim = true;
+        PIN_RemoveInstrumentation();
+        *result = "retire on trim: on\n";
         return true;
     }
-    else if(cmd == "mode off")
+    else if(cmd == "retire off")
     {
-        m = mode::OFF;
+        retire_on_trim = false;
+        SessionEnd();
+        UnretireAll();
+        PIN_RemoveInstrumentation();
+        *result = "retire on trim: off\n";
+        return true;
+    }
+    else if(cmd == "sample")
+    {
+        std::stringstream ss;
+        ss << "sample limit: " << (sample_default ? to_string(sample_default) : "off") << "\n";
+        for(const auto& x : sample_modules)
+            ss << "  " << x.first << ": " << (x.second ? to_string(x.second) : "off") << "\n";
+        *result = ss.str();
+        return true;
+    }
+    else if(cmd == "sample off")
+    {
+        sample_default = 0;
+        sample_modules.clear();
+        ApplySampling();
+        *result = "sampling off, all hits are counted\n";
+        return true;
+    }
+    else if(cmd.find("sample ") == 0)
+    {
+        //sample <limit> [module], a limit of 0 counts all hits
+        std::istringstream in(cmd.substr(std::strlen("sample ")));
+        std::string limit, mod;
+        in >> limit >> mod;
+        if(limit.find_first_not_of("0123456789") != std::string::npos)
+        {
+            *result = "usage: sample <limit> [module]\n";
+            return true;
+        }
+        const UINT32 n = (UINT32)std::strtoul(limit.c_str(), nullptr, 10);
+        if(mod.empty())
+            sample_default = n;
+        else
+            sample_modules[mod] = n;
+        ApplySampling();
+        *result = "sample limit " + (mod.empty() ? std::string("for all modules") : "for " + mod) + ": " + (n ? to_string(n) : "off") + "\n";
+        return true;
+    }
+    else if(cmd == "granularity")
+    {
+        *result = std::string("current granularity: ") + (gran == granularity::BBL ? "bbl" : "rtn") + "\n";
+        return true;
+    }
+    else if(cmd == "granularity bbl" || cmd == "granularity rtn")
+    {
+        if(probemode)
+        {
+            *result = "not available in probe mode\n";
+            return true;
+        }
+        const granularity g = cmd == "granularity bbl" ? granularity::BBL : granularity::RTN;
+        if(g == granularity::BBL && tracing())
+        {
+            *result = "not available with the binary event log (-b), it records function entries only\n";
+            return true;
+        }
+        if(g != gran)
+        {
+            gran = g;
+            PIN_RemoveInstrumentation();
+        }
+        *result = "new granularity: " + cmd.substr(std::strlen("granularity ")) + "\n";
+        return true;
+    }
+    else if(cmd == "schedule" || cmd.find("schedule ") == 0)
+    {
+        *result = ScheduleCommand(cmd.substr(std::strlen("schedule")));
+        return true;
+    }
+    else if(probemode && cmd.find("zoom") == 0)
+    {
+        *result = "not available in probe mode\n";
+        return true;
+    }
+    else if(cmd.find("zoom") == 0)
+    {
+        PIN_LockClient(); //block counters are added while jitting
+        *result = ZoomCommand(cmd.substr(std::strlen("zoom")));
+        PIN_UnlockClient();
+        return true;
+    }
+    else if(cmd.find("session") == 0)
+    {
+        *result = SessionCommand(cmd.substr(std::strlen("session")));
+        return true;
+    }
+    else if(cmd.find("snapshot") == 0)
+    {
+        *result = SnapshotCommand(cmd.substr(std::strlen("snapshot")));
+        return true;
+    }
+    else if(cmd == "mode collect" || cmd == "mode trim" || cmd == "mode off")
+    {
+        const std::string name = cmd.substr(std::strlen("mode "));
+        PIN_LockClient();
+        SetMode(name == "collect" ? mode::COLLECT : name == "trim" ? mode::TRIM : mode::OFF);
+        PIN_UnlockClient();
         *result = "new mode: " + modetostring(m) + "\n";
         return true;
     }
@@ -402,24 +2900,28 @@ bool execute_string_cmd(const std::string& cmd, std::string* result)
     {
         std::string mod = TrimWhitespace(cmd.substr(std::strlen("mod blacklist remove")));
         mod_black.erase(mod);
+        *result = to_string(ApplyModuleFilter()) + " modules changed\n";
         return true;
     }
     else if(cmd.find("mod whitelist remove") == 0)
     {
         std::string mod = TrimWhitespace(cmd.substr(std::strlen("mod whitelist remove")));
         mod_white.erase(mod);
+        *result = to_string(ApplyModuleFilter()) + " modules changed\n";
         return true;
     }
     else if(cmd.find("mod blacklist") == 0)
     {
         std::string mod = TrimWhitespace(cmd.substr(std::strlen("mod blacklist")));
         mod_black.insert(mod);
+        *result = to_string(ApplyModuleFilter()) + " modules changed\n";
         return true;
     }
     else if(cmd.find("mod whitelist") == 0)
     {
         std::string mod = TrimWhitespace(cmd.substr(std::strlen("mod whitelist")));
         mod_white.insert(mod);
+        *result = to_string(ApplyModuleFilter()) + " modules changed\n";
         return true;
     }
     else if(cmd.find("mod") == 0)
@@ -485,12 +2987,20 @@ int Usage()
 
 int main(int argc, char *argv[])
 {
+    //also with -symcache: which images miss the cache is only known at image load, pin needs the symbols then
     PIN_InitSymbols();
 
     if(PIN_Init(argc, argv))
         return Usage();
 
     port = KnobPort.Value();
+    probemode = KnobProbe.Value();
+    symcachedir = KnobSymCache.Value();
+    if(probemode && !KnobTrace.Value().empty())
+    {
+        std::cerr << "-b is not supported with -probe" << std::endl;
+        return -1;
+    }
     outFile.open(KnobOut.Value().c_str());
 
     if(!KnobDbg.Value().empty())
@@ -507,13 +3017,69 @@ int main(int argc, char *argv[])
     dbgLog << "tool: " << PIN_ToolFullPath() << std::endl;
     outFile << "time: " << timestamp << std::endl;
 
+    routines.init(ResolveRoutineName);
+    rtnshards.init();
+    blockshards.init();
+    PIN_InitLock(&probelock);
+    PIN_InitLock(&tracelock);
+    PIN_InitLock(&retirelock);
+    PIN_InitLock(&schedulelock);
+    PIN_SemaphoreInit(&schedulewake);
+    retire_on_trim = KnobRetire.Value() && !probemode;
+    sample_default = probemode ? 0 : KnobSample.Value();
+    rtnshards.reg = PIN_ClaimToolRegister();
+    blockshards.reg = PIN_ClaimToolRegister();
+    if(!REG_valid(rtnshards.reg) || !REG_valid(blockshards.reg))
+    {
+        std::cerr << "PIN_ClaimToolRegister() failed" << std::endl;
+        return -1;
+    }
+
+    if(!KnobTrace.Value().empty())
+    {
+        tracereg = PIN_ClaimToolRegister();
+        if(!REG_valid(tracereg) || !TraceOpen(KnobTrace.Value()))
+        {
+            std::cerr << "could not start binary event log " << KnobTrace.Value() << std::endl;
+            return -1;
+        }
+        LOG("writing binary event log to " + KnobTrace.Value() + "\n");
+        PIN_AddThreadStartFunction(TraceThreadStart, 0);
+        PIN_AddThreadFiniFunction(TraceThreadFini, 0);
+    }
+
+    if(!KnobShm.Value().empty())
+    {
+        if(!StatsOpen(KnobShm.Value()))
+        {
+            std::cerr << "could not create shared memory segment " << KnobShm.Value() << std::endl;
+            return -1;
+        }
+        LOG("publishing candidates in shared memory segment " + KnobShm.Value() + "\n");
+    }
+
+    if(tracing() || statsregion)
+        PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+
+    if(!probemode)
+    {
+        PIN_AddThreadStartFunction(ThreadStart, 0);
+        PIN_AddThreadFiniFunction(ThreadFini, 0);
+    }
     PIN_AddDebugInterpreter(DebugInterpreter, 0);
-    RTN_AddInstrumentFunction(Routine, 0);
+    if(!probemode)
+        TRACE_AddInstrumentFunction(Trace, 0);
     PIN_AddFiniFunction(Fini, 0);
     IMG_AddInstrumentFunction(ImgLoad, 0);
+    IMG_AddUnloadFunction(ImgUnload, 0);
 
     block_until_connect();
 
+    if(probemode)
+    {
+        PIN_StartProgramProbed();
+        return 0;
+    }
     PIN_StartProgram();
     return 0;
 }
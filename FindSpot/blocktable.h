@@ -0,0 +1,65 @@
+#ifndef BLOCKTABLEH
+#define BLOCKTABLEH
+
+
+#include <unordered_map>
+
+#include "routinetable.h"
+
+
+//a basic block seen while jitting in bbl granularity
+struct BlockInfo
+{
+    ADDRINT address = 0;
+    UINT32 routine = 0; //id in the RoutineTable
+};
+
+
+/*
+* Registry of basic blocks for bbl granularity.
+* Blocks get a dense id when they are first jitted, so only executed code costs memory.
+* Presence is a bitmap indexed by block id, hit counts live in the per-thread shards like the
+* routine counts.
+*/
+class BlockTable
+{
+public:
+    static const UINT32 INVALID_ID = UINT32(-1);
+
+    UINT32 add(ADDRINT adr, UINT32 routine)
+    {
+        auto it = byaddress.find(adr);
+        if(it != byaddress.end())
+            return it->second;
+
+        BlockInfo b;
+        b.address = adr;
+        b.routine = routine;
+        if(!presence.grow(blocks.size()))
+            return INVALID_ID;
+        const size_t id = blocks.push_back(b);
+        if(id == decltype(blocks)::MAX_SIZE)
+            return INVALID_ID;
+        byaddress.emplace(adr, (UINT32)id);
+        return (UINT32)id;
+    }
+
+    UINT32 find(ADDRINT adr) const
+    {
+        auto it = byaddress.find(adr);
+        return it == byaddress.end() ? INVALID_ID : it->second;
+    }
+
+    size_t size() const { return blocks.size(); }
+    ADDRINT address(UINT32 id) const { return blocks[id].address; }
+    UINT32 routine(UINT32 id) const { return blocks[id].routine; }
+
+    PresenceBitmap presence;
+
+private:
+    ChunkedArray<BlockInfo> blocks;
+    std::unordered_map<ADDRINT, UINT32> byaddress;
+};
+
+
+#endif
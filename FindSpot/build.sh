@@ -8,6 +8,14 @@ echo building cli...
 cd findspot-cli
 make
 cd ..
+echo building trace decoder...
+cd findspot-trace
+make
+cd ..
+echo building dump diff...
+cd findspot-diff
+make
+cd ..
 echo building example...
 cd example-1
 make
@@ -0,0 +1,142 @@
+#ifndef DUMPFORMATH
+#define DUMPFORMATH
+
+
+/*
+binary dump format, written by "dump -b <file>" and read (mmapped) by findspot-diff
+
+    DumpHeader
+    DumpRow[rows]                 fixed width rows
+    uint32_t[strings]             offset of every string in the string blob
+    char[stringbytes]             string blob, zero terminated strings
+
+Rows refer to module and symbol names by string id, addresses are stored relative to the
+module load address, so dumps of different runs can be compared despite ASLR.
+note: shared between the pintool and the standalone tools, so no pin types in here
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+
+#define DUMP_MAGIC "FSDUMP1"
+#define DUMP_VERSION 1
+
+enum DumpFlags : uint32_t
+{
+    DUMP_FLAG_BLOCKS = 1, //rows are basic blocks instead of functions
+};
+
+struct DumpHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t rows;
+    uint64_t rowsoffset;
+    uint64_t strings;
+    uint64_t stringsoffset;     //offset table
+    uint64_t stringbytes;
+    uint64_t stringbloboffset;
+};
+
+struct DumpRow
+{
+    uint64_t rva;
+    uint64_t count;
+    uint32_t module; //string id
+    uint32_t symbol; //string id
+    uint32_t order;  //first hit order, 0 based
+    uint32_t reserved;
+};
+static_assert(sizeof(DumpRow) == 32, "dump rows are written as raw 32 byte blocks");
+
+
+//builds the string table while rows are added
+class DumpStringTable
+{
+public:
+    uint32_t intern(const std::string& str)
+    {
+        auto it = index.find(str);
+        if(it != index.end())
+            return it->second;
+        const uint32_t id = (uint32_t)offsets.size();
+        offsets.push_back((uint32_t)blob.size());
+        blob.append(str);
+        blob.push_back('\0');
+        index.emplace(str, id);
+        return id;
+    }
+
+    std::vector<uint32_t> offsets;
+    std::string blob;
+
+private:
+    std::unordered_map<std::string, uint32_t> index;
+};
+
+template <typename Stream>
+void WriteDump(Stream& out, const std::vector<DumpRow>& rows, const DumpStringTable& strings, uint32_t flags)
+{
+    DumpHeader h{};
+    std::memcpy(h.magic, DUMP_MAGIC, sizeof(h.magic));
+    h.version = DUMP_VERSION;
+    h.flags = flags;
+    h.rows = rows.size();
+    h.rowsoffset = sizeof(DumpHeader);
+    h.strings = strings.offsets.size();
+    h.stringsoffset = h.rowsoffset + rows.size() * sizeof(DumpRow);
+    h.stringbytes = strings.blob.size();
+    h.stringbloboffset = h.stringsoffset + strings.offsets.size() * sizeof(uint32_t);
+
+    out.write((const char*)&h, sizeof(h));
+    out.write((const char*)rows.data(), rows.size() * sizeof(DumpRow));
+    out.write((const char*)strings.offsets.data(), strings.offsets.size() * sizeof(uint32_t));
+    out.write(strings.blob.data(), strings.blob.size());
+}
+
+
+//read only view of a dump in memory (e.g. mmapped), nothing is parsed or copied
+class DumpView
+{
+public:
+    //returns false if data is not a valid dump
+    bool open(const char* data, uint64_t size)
+    {
+        if(size < sizeof(DumpHeader))
+            return false;
+        header = (const DumpHeader*)data;
+        if(std::memcmp(header->magic, DUMP_MAGIC, sizeof(header->magic)) != 0 || header->version != DUMP_VERSION)
+            return false;
+        if(header->rowsoffset + header->rows * sizeof(DumpRow) > size
+            || header->stringsoffset + header->strings * sizeof(uint32_t) > size
+            || header->stringbloboffset + header->stringbytes > size)
+            return false;
+        base = data;
+        return true;
+    }
+
+    uint64_t rows() const { return header->rows; }
+    const DumpRow& row(uint64_t i) const { return ((const DumpRow*)(base + header->rowsoffset))[i]; }
+    bool blocks() const { return header->flags & DUMP_FLAG_BLOCKS; }
+
+    uint64_t strings() const { return header->strings; }
+    const char* string(uint32_t id) const
+    {
+        if(id >= header->strings)
+            return "???";
+        const uint32_t offset = ((const uint32_t*)(base + header->stringsoffset))[id];
+        return offset < header->stringbytes ? base + header->stringbloboffset + offset : "???";
+    }
+
+private:
+    const DumpHeader* header = nullptr;
+    const char* base = nullptr;
+};
+
+
+#endif
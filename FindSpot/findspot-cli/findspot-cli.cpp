@@ -1,17 +1,241 @@
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "../socklib.h"
 #include "../packetmanager.h"
+#include "../statsregion.h"
 
 
 void printusage()
 {
   std::cerr << "findspot [port]\ndefault port is " << FS_PORT << std::endl;
+  std::cerr << "findspot -f <command file> [port]\nruns the commands in the file (one per line, # comments, sleep <ms>) and exits" << std::endl;
+  std::cerr << "findspot watch <segment> [rows] [interval ms]\nlive view of a target started with -shm <segment>" << std::endl;
+}
+
+//renders the shared stats region of the pintool until the segment goes away, no round trips to the target
+int watch(const std::string& name, size_t maxrows, int interval)
+{
+#ifdef _WIN32
+  std::cerr << "watch needs posix shared memory, not available on windows" << std::endl;
+  return 1;
+#else
+  const int fd = shm_open(name.c_str(), O_RDWR, 0); //writable for StatsPoll
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(StatsHeader))
+  {
+    std::cerr << "could not open shared memory segment " << name << std::endl;
+    return 1;
+  }
+  char* base = (char*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+  {
+    std::cerr << "could not map shared memory segment " << name << std::endl;
+    return 1;
+  }
+
+  StatsCopy copy;
+  std::vector<const DumpRow*> top;
+  std::string out;
+  char buf[64];
+  while(1)
+  {
+    //the tool updates the region on its next tick, so the view lags one interval
+    StatsPoll(base);
+    if(!StatsRead(base, copy))
+    {
+      usleep(interval * 1000);
+      continue;
+    }
+
+    top.clear();
+    for(const DumpRow& r : copy.rows)
+      top.push_back(&r);
+    const size_t k = std::min(maxrows, top.size());
+    std::partial_sort(top.begin(), top.begin() + k, top.end(), [](const DumpRow* a, const DumpRow* b) {
+      return a->count != b->count ? a->count > b->count : a->order < b->order;
+    });
+
+    //clear screen, then everything in one write
+    out = "\x1b[H\x1b[2J";
+    snprintf(buf, sizeof(buf), "mode: %s  candidates: %llu  update: %llu\n", statsmodetostring(copy.header.mode),
+      (unsigned long long)copy.header.candidates, (unsigned long long)copy.header.updates);
+    out += buf;
+    snprintf(buf, sizeof(buf), "%18s %12s %20s ", "RVA", "Hits", "Module");
+    out += buf;
+    out += copy.header.flags & DUMP_FLAG_BLOCKS ? "Block\n" : "Symbol\n";
+    for(size_t i = 0; i < k; i++)
+    {
+      snprintf(buf, sizeof(buf), "%18llx %12llu ", (unsigned long long)top[i]->rva, (unsigned long long)top[i]->count);
+      out += buf;
+      snprintf(buf, sizeof(buf), "%20s ", copy.string(top[i]->module));
+      out += buf;
+      out += copy.string(top[i]->symbol);
+      out += "\n";
+    }
+    if(k < top.size())
+      out += "<...>\n";
+    std::cout << out << std::flush;
+
+    //the pintool removes the segment when the target exits
+    const int check = shm_open(name.c_str(), O_RDONLY, 0);
+    if(check < 0)
+    {
+      std::cout << "target exited" << std::endl;
+      return 0;
+    }
+    close(check);
+    usleep(interval * 1000);
+  }
+#endif
+}
+
+//batch files: skip empty lines and # comments
+bool skipline(const std::string& cmd)
+{
+  const size_t pos = cmd.find_first_not_of(" \t\r");
+  return pos == std::string::npos || cmd[pos] == '#';
+}
+
+//batch files: "sleep <ms>" waits in the controller, e.g. for a schedule to finish
+bool localsleep(const std::string& cmd)
+{
+  if(cmd.find("sleep ") != 0)
+    return false;
+#ifdef _WIN32
+  WINDOWS::Sleep(atoi(cmd.c_str() + 6));
+#else
+  usleep(atoi(cmd.c_str() + 6) * 1000);
+#endif
+  return true;
+}
+
+/*
+* v2 session: all lines already buffered on the input (pasted blocks, piped scripts, batch files)
+* are sent before the first result is read, results are printed chunk by chunk as they arrive.
+* In batch mode every result is preceded by its command.
+*/
+int run_pipelined(FindSpotPacketManager& manager, std::istream& in, bool batch)
+{
+  const size_t MAX_IN_FLIGHT = 64;
+
+  uint32_t next = 1;
+  std::string cmd, chunk;
+  std::vector<std::string> sent;
+  FrameHeader h;
+  while(1)
+  {
+    if(!batch)
+      std::cout << "findspot>" << std::flush;
+    if(!std::getline(in, cmd))
+      return 0;
+    if(batch && (skipline(cmd) || localsleep(cmd)))
+      continue;
+
+    sent.clear();
+    do
+    {
+      if(batch && skipline(cmd))
+        continue;
+      if(batch && cmd.find("sleep ") == 0)
+        break; //handled after the results are in
+      if(!manager.send_frame(FRAME_COMMAND, next++, 0, cmd.data(), cmd.size()))
+      {
+        std::cerr << "connection lost" << std::endl;
+        return 1;
+      }
+      sent.push_back(cmd);
+      cmd.clear();
+    } while(sent.size() < MAX_IN_FLIGHT && in.rdbuf()->in_avail() > 0 && std::getline(in, cmd));
+
+    //the tool answers in order, one result (possibly chunked) per request
+    size_t done = 0;
+    bool start = true;
+    while(done < sent.size())
+    {
+      if(!manager.recv_frame(h, chunk))
+      {
+        std::cerr << "connection lost" << std::endl;
+        return 1;
+      }
+      if(h.type != FRAME_RESULT)
+        continue;
+      if(batch && start)
+        std::cout << "findspot>" << sent[done] << "\n";
+      start = false;
+      std::cout << chunk;
+      if(!(h.flags & FRAME_MORE))
+      {
+        std::cout << std::endl;
+        done++;
+        start = true;
+      }
+    }
+    if(batch)
+      localsleep(cmd);
+  }
+}
+
+//v1 tools: one command at a time
+int run_simple(FindSpotPacketManager& manager, std::istream& in, bool batch)
+{
+  while(1)
+  {
+    if(!batch)
+      std::cout << "findspot>";
+    std::string cmd;
+    if(!std::getline(in, cmd))
+      return 0;
+    if(batch && (skipline(cmd) || localsleep(cmd)))
+      continue;
+    if(batch)
+      std::cout << "findspot>" << cmd << "\n";
+    manager.send_cmd(cmd);
+    std::cout << manager.recv_cmd_block() << std::endl;
+  }
 }
 
 int main(int argc, char** argv)
 {
+  if(argc >= 3 && std::string(argv[1]) == "watch")
+  {
+    const size_t rows = argc >= 4 ? (size_t)atoi(argv[3]) : 20;
+    const int interval = argc >= 5 ? atoi(argv[4]) : 100;
+    if(rows == 0 || interval <= 0 || argc > 5)
+    {
+      printusage();
+      return 0;
+    }
+    return watch(argv[2], rows, interval);
+  }
+
+  //findspot -f <command file> [port]
+  std::ifstream batchfile;
+  if(argc >= 3 && std::string(argv[1]) == "-f")
+  {
+    batchfile.open(argv[2]);
+    if(!batchfile.is_open())
+    {
+      std::cerr << "could not open " << argv[2] << std::endl;
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  const bool batch = batchfile.is_open();
+
   int port = FS_PORT;
   if(argc == 2)
   {
@@ -27,16 +251,16 @@ int main(int argc, char** argv)
   std::cout << "using port " << port << std::endl;
   FindSpotPacketManager manager;
   manager.clientfd = manager.try_connect(port);
-  std::cout << manager.recv_cmd_block() << std::endl;;
+  std::cout << manager.recv_cmd_block() << std::endl;
 
-  while(1)
-  {
-    std::cout << "findspot>";
-    std::string cmd;
-    std::getline(std::cin, cmd);
-    manager.send_cmd(cmd);
-    std::cout << manager.recv_cmd_block() << std::endl;
-  }
+  //newer tools switch to v2 framing, older ones answer "unknown command" and we stay with v1
+  manager.send_cmd(PROTOCOL_CMD);
+  if(manager.recv_cmd_block() == PROTOCOL_CMD)
+    manager.version = 2;
 
-  return 0;
+  std::ios::sync_with_stdio(false); //otherwise cin never reports buffered input
+  std::istream& in = batch ? (std::istream&)batchfile : std::cin;
+  if(manager.version == 1)
+    return run_simple(manager, in, batch);
+  return run_pipelined(manager, in, batch);
 }
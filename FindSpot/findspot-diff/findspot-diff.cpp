@@ -0,0 +1,199 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "../dumpformat.h"
+
+
+void printusage()
+{
+  std::cerr << "findspot-diff <intersect|diff|rank> <dump> [dump...]\n"
+    << "  intersect  -- entries present in all dumps\n"
+    << "  diff       -- entries of the first dump that are in none of the others\n"
+    << "  rank       -- all entries, most dumps first, then by total hits\n"
+    << "dumps are written with \"dump -b <file>\", entries are matched by module and relative address" << std::endl;
+}
+
+//maps a whole file read only, the mapping lives until the process exits
+const char* mapfile(const char* path, uint64_t& size)
+{
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE)
+    return nullptr;
+  LARGE_INTEGER li;
+  if(!GetFileSizeEx(file, &li) || li.QuadPart == 0)
+    return nullptr;
+  size = (uint64_t)li.QuadPart;
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(!mapping)
+    return nullptr;
+  return (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return nullptr;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    close(fd);
+    return nullptr;
+  }
+  size = (uint64_t)st.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? nullptr : (const char*)p;
+#endif
+}
+
+//module (global id) + relative address
+struct EntryKey
+{
+  uint32_t module;
+  uint64_t rva;
+  bool operator==(const EntryKey& o) const { return module == o.module && rva == o.rva; }
+};
+
+struct EntryKeyHash
+{
+  size_t operator()(const EntryKey& k) const { return std::hash<uint64_t>()(k.rva * 31 + k.module); }
+};
+
+//one module+rva across all dumps, counts[i] == 0 if not in dump i
+struct Entry
+{
+  const DumpRow* row;   //first row seen, used for names
+  uint32_t dump;        //dump the row belongs to
+  uint32_t present = 0;
+  uint64_t total = 0;
+  std::vector<uint64_t> counts;
+};
+
+int main(int argc, char** argv)
+{
+  if(argc < 3)
+  {
+    printusage();
+    return 1;
+  }
+
+  const std::string op = argv[1];
+  if(op != "intersect" && op != "diff" && op != "rank")
+  {
+    printusage();
+    return 1;
+  }
+
+  std::vector<DumpView> dumps;
+  for(int i = 2; i < argc; i++)
+  {
+    uint64_t size = 0;
+    const char* data = mapfile(argv[i], size);
+    DumpView v;
+    if(!data || !v.open(data, size))
+    {
+      std::cerr << "could not map " << argv[i] << " or not a findspot dump (version " << DUMP_VERSION << ")" << std::endl;
+      return 1;
+    }
+    //a block row and a function row at the same address are different things
+    if(!dumps.empty() && v.blocks() != dumps[0].blocks())
+    {
+      std::cerr << argv[i] << " was dumped in " << (v.blocks() ? "bbl" : "rtn") << " granularity, " << argv[2]
+                << " in " << (dumps[0].blocks() ? "bbl" : "rtn") << ", only dumps of the same granularity can be compared" << std::endl;
+      return 1;
+    }
+    dumps.push_back(v);
+  }
+  const size_t n = dumps.size();
+
+  //module names are the only strings compared, symbols are printed straight from the mapping
+  std::unordered_map<std::string, uint32_t> modules;
+  std::unordered_map<EntryKey, uint32_t, EntryKeyHash> index;
+  std::vector<Entry> entries;
+  for(size_t d = 0; d < n; d++)
+  {
+    const DumpView& v = dumps[d];
+    std::vector<uint32_t> modmap(v.strings(), UINT32_MAX);
+    for(uint64_t r = 0; r < v.rows(); r++)
+    {
+      const DumpRow& row = v.row(r);
+      if(row.module >= modmap.size())
+        continue;
+      if(modmap[row.module] == UINT32_MAX)
+        modmap[row.module] = modules.emplace(v.string(row.module), (uint32_t)modules.size()).first->second;
+
+      const EntryKey key{modmap[row.module], row.rva};
+      auto it = index.find(key);
+      if(it == index.end())
+      {
+        //diff only needs entries of the first dump
+        if(op != "rank" && d > 0)
+          continue;
+        it = index.emplace(key, (uint32_t)entries.size()).first;
+        entries.emplace_back();
+        entries.back().row = &row;
+        entries.back().dump = (uint32_t)d;
+        entries.back().counts.resize(n);
+      }
+      Entry& e = entries[it->second];
+      if(!e.counts[d])
+        e.present++;
+      e.counts[d] += row.count;
+      e.total += row.count;
+    }
+  }
+
+  std::vector<const Entry*> out;
+  for(const Entry& e : entries)
+  {
+    if(op == "intersect" && e.present != n)
+      continue;
+    if(op == "diff" && (e.present != 1 || !e.counts[0]))
+      continue;
+    out.push_back(&e);
+  }
+  if(op == "rank")
+  {
+    std::stable_sort(out.begin(), out.end(), [](const Entry* a, const Entry* b) {
+      return a->present != b->present ? a->present > b->present : a->total > b->total;
+    });
+  }
+
+  std::string line;
+  line = "Module\tRVA";
+  for(size_t d = 0; d < n; d++)
+    line += "\t" + std::string(argv[d + 2]);
+  std::cout << line << "\tSymbol\n";
+  char buf[32];
+  for(const Entry* e : out)
+  {
+    const DumpView& v = dumps[e->dump];
+    line = v.string(e->row->module);
+    snprintf(buf, sizeof(buf), "\t0x%llx", (unsigned long long)e->row->rva);
+    line += buf;
+    for(size_t d = 0; d < n; d++)
+    {
+      snprintf(buf, sizeof(buf), "\t%llu", (unsigned long long)e->counts[d]);
+      line += buf;
+    }
+    line += "\t";
+    line += v.string(e->row->symbol);
+    line += "\n";
+    std::cout << line;
+  }
+  std::cerr << out.size() << " entries" << std::endl;
+
+  return 0;
+}
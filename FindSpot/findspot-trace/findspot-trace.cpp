@@ -0,0 +1,110 @@
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "../helper.h"
+#include "../tracelog.h"
+
+
+struct SymInfo
+{
+  std::string address;
+  std::string image;
+  std::string name;
+};
+
+
+void printusage()
+{
+  std::cerr << "findspot-trace <trace file> [symbol file]\ndefault symbol file is <trace file>.sym" << std::endl;
+}
+
+//reads the "id address image name" lines written by the pintool
+bool load_symbols(const std::string& path, std::unordered_map<uint32_t, SymInfo>& syms)
+{
+  std::ifstream file(path.c_str());
+  if(!file.is_open())
+    return false;
+
+  std::string line;
+  while(std::getline(file, line))
+  {
+    size_t t1 = line.find('\t');
+    size_t t2 = line.find('\t', t1 + 1);
+    size_t t3 = line.find('\t', t2 + 1);
+    if(t1 == std::string::npos || t2 == std::string::npos || t3 == std::string::npos)
+      continue;
+    SymInfo& s = syms[(uint32_t)std::stoul(line.substr(0, t1))];
+    s.address = line.substr(t1 + 1, t2 - t1 - 1);
+    s.image = line.substr(t2 + 1, t3 - t2 - 1);
+    s.name = line.substr(t3 + 1);
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2 || argc > 3)
+  {
+    printusage();
+    return 1;
+  }
+
+  const std::string tracepath = argv[1];
+  const std::string sympath = argc == 3 ? argv[2] : tracepath + ".sym";
+
+  std::unordered_map<uint32_t, SymInfo> syms;
+  if(!load_symbols(sympath, syms))
+    std::cerr << "could not read symbol file " << sympath << ", printing routine ids only" << std::endl;
+
+  std::ifstream file(tracepath.c_str(), std::ios::binary);
+  if(!file.is_open())
+  {
+    std::cerr << "could not open " << tracepath << std::endl;
+    return 1;
+  }
+
+  TraceFileHeader header{};
+  file.read((char*)&header, sizeof(header));
+  if(!file || std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+    || header.version != TRACE_VERSION || header.recordsize != sizeof(TraceRecord))
+  {
+    std::cerr << tracepath << " is not a findspot trace (version " << TRACE_VERSION << ")" << std::endl;
+    return 1;
+  }
+
+  //records are in drain order, i.e. ordered per thread but interleaved between threads
+  std::vector<TraceRecord> buf(1 << 16);
+  std::string out;
+  size_t total = 0;
+  while(file)
+  {
+    file.read((char*)buf.data(), buf.size() * sizeof(TraceRecord));
+    const size_t n = file.gcount() / sizeof(TraceRecord);
+    out.clear();
+    for(size_t i = 0; i < n; i++)
+    {
+      const TraceRecord& r = buf[i];
+      out += to_string(r.tsc - header.tscstart);
+      out += " ";
+      out += to_string(r.thread);
+      out += " ";
+      out += tracekindtostring(r.kind);
+      out += ": ";
+      auto it = syms.find(r.routine);
+      if(it != syms.end())
+        out += it->second.address + " " + it->second.image + " " + it->second.name;
+      else
+        out += "routine#" + to_string(r.routine);
+      out += "\n";
+    }
+    std::cout << out;
+    total += n;
+  }
+  std::cerr << total << " records" << std::endl;
+
+  return 0;
+}
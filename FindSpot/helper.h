@@ -12,6 +12,10 @@
 
 #include <iomanip>
 
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
 
 #define assertm(exp, msg) assert(((void)msg, exp))
 
@@ -134,6 +138,27 @@ constexpr int NumDigits(int x)
         10)))))))));  
 }
 
+//index of the lowest set bit, v must not be 0
+inline uint32_t lowest_bit64(uint64_t v)
+{
+#ifdef _WIN32
+    unsigned long i = 0;
+    _BitScanForward64(&i, v);
+    return (uint32_t)i;
+#else
+    return (uint32_t)__builtin_ctzll(v);
+#endif
+}
+
+inline uint32_t popcount64(uint64_t v)
+{
+#ifdef _WIN32
+    return (uint32_t)__popcnt64(v);
+#else
+    return (uint32_t)__builtin_popcountll(v);
+#endif
+}
+
 std::string datetimestring()
 {
     std::time_t result = std::time(nullptr);
@@ -4,12 +4,83 @@
 #define FS_PORT 8022
 #define PACK_LEN 8
 
+//v2 framing, switched to with the "protocol 2" command after the v1 hello
+#define PROTOCOL_CMD "protocol 2"
+#define FRAME_CHUNK (64 * 1024)
+
 
 #include "socklib.h"
 #include "helper.h"
 
 #include <string>
 #include <iostream>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+
+/*
+* v2 frame: fixed header followed by length bytes of payload, little endian like the hosts.
+* Every command carries a request id chosen by the client, all result frames of that command
+* carry the same id, so the client can send several commands before reading the results.
+* Large results are split into chunks, all but the last one have FRAME_MORE set.
+*/
+enum FrameType : uint8_t
+{
+    FRAME_COMMAND = 1, //client -> tool, payload is the command text
+    FRAME_RESULT = 2,  //tool -> client, payload is (a chunk of) the result text
+};
+
+enum FrameFlags : uint8_t
+{
+    FRAME_MORE = 1, //more chunks of this result follow
+};
+
+struct FrameHeader
+{
+    uint32_t length;
+    uint32_t request;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+};
+static_assert(sizeof(FrameHeader) == 12, "frame headers are sent as raw 12 byte blocks");
+
+
+/*
+* A reply waiting for a writable socket. The result is moved in, not copied, the frame headers
+* (or the v1 length) are kept next to it and both are sent with gathered writes.
+*/
+struct QueuedReply
+{
+    std::string headers;
+    std::string result;
+    std::vector<pin_iovec> parts; //slices of headers and result in send order
+    size_t next = 0;              //first part not completely sent
+
+    void add(const char* base, size_t len)
+    {
+        pin_iovec v;
+        v.base = base;
+        v.len = len;
+        parts.push_back(v);
+    }
+
+    //drops n sent bytes from the front
+    void consume(size_t n)
+    {
+        while(next < parts.size() && n >= parts[next].len)
+            n -= parts[next++].len;
+        if(next < parts.size())
+        {
+            parts[next].base += n;
+            parts[next].len -= n;
+        }
+    }
+
+    bool done() const { return next == parts.size(); }
+};
 
 
 class FindSpotPacketManager
@@ -18,6 +89,9 @@ public:
 
     PIN_SOCKET clientfd = INVALID_SOCKET;
     bool extended_dbg = false;
+    int version = 1; //framing in use, 2 after the "protocol 2" handshake
+    std::string inbuf;             //received, not yet complete requests (non blocking use)
+    std::deque<QueuedReply> outq;  //queued replies (non blocking use), elements never move
 
     explicit FindSpotPacketManager(PIN_SOCKET sock = INVALID_SOCKET) : clientfd(sock)
     {
@@ -81,23 +155,172 @@ public:
         return sent;
     }
 
-    PIN_SOCKET block_accept(int port)
+    //v2: receives one frame, payload reuses the capacity of the given string
+    bool recv_frame(FrameHeader& h, std::string& payload)
+    {
+        if(pin_recv(clientfd, (char*)&h, sizeof(h)) != (int)sizeof(h))
+            return false;
+        payload.resize(h.length);
+        if(h.length && pin_recv(clientfd, &payload[0], h.length) != (int)h.length)
+            return false;
+        if(extended_dbg)
+            std::cout << "frame received: " << h.request << " " << payload << std::endl;
+        return true;
+    }
+
+    //v2: header and payload go out in one gathered write
+    bool send_frame(FrameType type, uint32_t request, uint8_t flags, const char* data, size_t len)
+    {
+        FrameHeader h{};
+        h.length = (uint32_t)len;
+        h.request = request;
+        h.type = type;
+        h.flags = flags;
+        return pin_sendv(clientfd, (const char*)&h, sizeof(h), data, len) == (int)(sizeof(h) + len);
+    }
+
+    /*
+    * Non blocking use (tool side event loop): incoming bytes are collected in inbuf and split
+    * into requests, replies are queued in outq and sent whenever the socket is writable,
+    * so a slow controller never blocks the others.
+    */
+
+    //reads what is available, false if the peer is gone
+    bool on_readable()
     {
-        struct pin_sockaddr_in serverAddr, cliAddr;
+        char buf[16 * 1024];
+        while(1)
+        {
+            int r = pin_recv_some(clientfd, buf, sizeof(buf));
+            if(r > 0)
+            {
+                inbuf.append(buf, r);
+                continue;
+            }
+            return r < 0 && pin_wouldblock();
+        }
+    }
+
+    //takes the next complete request out of inbuf, request is 0 in v1
+    bool next_request(std::string& cmd, uint32_t& request)
+    {
+        request = 0;
+        if(version == 1)
+        {
+            if(inbuf.size() < PACK_LEN)
+                return false;
+            const size_t packetlen = fromhex(inbuf.substr(0, PACK_LEN));
+            if(inbuf.size() < PACK_LEN + packetlen)
+                return false;
+            cmd.assign(inbuf, PACK_LEN, packetlen);
+            inbuf.erase(0, PACK_LEN + packetlen);
+            return true;
+        }
+        while(inbuf.size() >= sizeof(FrameHeader))
+        {
+            FrameHeader h;
+            memcpy(&h, inbuf.data(), sizeof(h));
+            if(inbuf.size() < sizeof(h) + h.length)
+                return false;
+            cmd.assign(inbuf, sizeof(h), h.length);
+            inbuf.erase(0, sizeof(h) + h.length);
+            if(h.type == FRAME_COMMAND)
+            {
+                request = h.request;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //queues a reply in the framing of the connection and sends what the socket takes right away
+    bool queue_reply(uint32_t request, std::string result)
+    {
+        outq.emplace_back();
+        QueuedReply& q = outq.back();
+        q.result.swap(result);
+        if(version == 1)
+        {
+            char num[32]{};
+            sprintf(num, "%08X", (unsigned int)q.result.length());
+            q.headers = num;
+            q.add(q.headers.data(), q.headers.size());
+            q.add(q.result.data(), q.result.size());
+        }
+        else
+        {
+            //all headers first, the parts point into them once they stopped growing
+            const size_t chunks = std::max<size_t>(1, (q.result.size() + FRAME_CHUNK - 1) / FRAME_CHUNK);
+            for(size_t i = 0; i < chunks; i++)
+            {
+                const size_t pos = i * FRAME_CHUNK;
+                FrameHeader h{};
+                h.length = (uint32_t)std::min(q.result.size() - pos, (size_t)FRAME_CHUNK);
+                h.request = request;
+                h.type = FRAME_RESULT;
+                h.flags = i + 1 < chunks ? FRAME_MORE : 0;
+                q.headers.append((const char*)&h, sizeof(h));
+            }
+            for(size_t i = 0; i < chunks; i++)
+            {
+                const size_t pos = i * FRAME_CHUNK;
+                q.add(q.headers.data() + i * sizeof(FrameHeader), sizeof(FrameHeader));
+                q.add(q.result.data() + pos, std::min(q.result.size() - pos, (size_t)FRAME_CHUNK));
+            }
+        }
+        return on_writable();
+    }
+
+    bool wants_write() const { return !outq.empty(); }
+
+    //sends as much of the queued replies as possible, false if the peer is gone
+    bool on_writable()
+    {
+        while(!outq.empty())
+        {
+            QueuedReply& q = outq.front();
+            while(!q.done())
+            {
+                int r = pin_sendv_some(clientfd, &q.parts[q.next], q.parts.size() - q.next);
+                if(r <= 0)
+                    return r < 0 && pin_wouldblock();
+                q.consume(r);
+            }
+            outq.pop_front();
+        }
+        return true;
+    }
+
+    //listening socket for accept_client()
+    static PIN_SOCKET listen_on(int port)
+    {
+        struct pin_sockaddr_in serverAddr;
         PIN_SOCKET sockfd = pin_socket(PF_INET, SOCK_STREAM, 0);
+        if(sockfd == INVALID_SOCKET)
+            return INVALID_SOCKET;
+
+        //controllers come and go, dont block the port after a restart
+        int one = 1;
+        pin_setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
         serverAddr.sin_family = AF_INET;
         serverAddr.sin_port = pin_htons(port);
         serverAddr.sin_addr.s_addr = INADDR_ANY;
 
         pin_bind(sockfd, (struct pin_sockaddr*)&serverAddr, sizeof(serverAddr));
+        if(pin_listen(sockfd, 5) != 0)
+        {
+            pin_closesocket(sockfd);
+            return INVALID_SOCKET;
+        }
+        return sockfd;
+    }
 
+    static PIN_SOCKET accept_client(PIN_SOCKET sockfd)
+    {
+        struct pin_sockaddr_in cliAddr;
         pin_socklen_t addr_size = sizeof(cliAddr);
-        PIN_SOCKET clientfd = INVALID_SOCKET;
-        if (pin_listen(sockfd, 5) == 0)
-            clientfd = pin_accept(sockfd, (struct pin_sockaddr*)&cliAddr, &addr_size); // accept the connection
-        
-        return clientfd;
+        return pin_accept(sockfd, (struct pin_sockaddr*)&cliAddr, &addr_size);
     }
 
     PIN_SOCKET try_connect(int port)
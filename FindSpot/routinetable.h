@@ -0,0 +1,460 @@
+#ifndef ROUTINETABLEH
+#define ROUTINETABLEH
+
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+#include "helper.h"
+
+
+/*
+* Array that grows in fixed size chunks.
+* Elements never move once created, so pointers into it stay valid for the lifetime of the
+* tool and readers can access [0, size()) while a single writer appends.
+*/
+template <typename T, size_t CHUNK_BITS = 12, size_t MAX_CHUNKS = 4096>
+class ChunkedArray
+{
+public:
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+    static const size_t MAX_SIZE = CHUNK_SIZE * MAX_CHUNKS;
+
+    ChunkedArray() = default;
+    ChunkedArray(const ChunkedArray&) = delete;
+    ChunkedArray& operator=(const ChunkedArray&) = delete;
+    ~ChunkedArray()
+    {
+        for(T* chunk : chunks)
+            delete[] chunk;
+    }
+
+    size_t size() const { return count; }
+
+    T& operator[](size_t i) { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; }
+    const T& operator[](size_t i) const { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; }
+
+    //returns the index of the new element, or MAX_SIZE if full
+    size_t push_back(const T& t)
+    {
+        if(count >= MAX_SIZE)
+            return MAX_SIZE;
+        T*& chunk = chunks[count >> CHUNK_BITS];
+        if(!chunk)
+            chunk = new T[CHUNK_SIZE]();
+        chunk[count & (CHUNK_SIZE - 1)] = t;
+        count = count + 1; //publish after the element is written
+        return count - 1;
+    }
+
+private:
+    T* chunks[MAX_CHUNKS]{};
+    volatile size_t count = 0;
+};
+
+
+inline UINT64 atomic_or64(UINT64* p, UINT64 v)
+{
+#ifdef _WIN32
+    return (UINT64)_InterlockedOr64((volatile __int64*)p, (__int64)v);
+#else
+    return __sync_fetch_and_or(p, v);
+#endif
+}
+
+inline UINT64 atomic_and64(UINT64* p, UINT64 v)
+{
+#ifdef _WIN32
+    return (UINT64)_InterlockedAnd64((volatile __int64*)p, (__int64)v);
+#else
+    return __sync_fetch_and_and(p, v);
+#endif
+}
+
+inline bool atomic_cas64(UINT64* p, UINT64 expected, UINT64 desired)
+{
+#ifdef _WIN32
+    return (UINT64)_InterlockedCompareExchange64((volatile __int64*)p, (__int64)desired, (__int64)expected) == expected;
+#else
+    return __sync_bool_compare_and_swap(p, expected, desired);
+#endif
+}
+
+//returns the value before the increment
+inline UINT32 atomic_next32(volatile UINT32* p)
+{
+#ifdef _WIN32
+    return (UINT32)_InterlockedExchangeAdd((volatile long*)p, 1);
+#else
+    return __sync_fetch_and_add(p, 1);
+#endif
+}
+
+inline void atomic_add64(volatile INT64* p, INT64 v)
+{
+#ifdef _WIN32
+    _InterlockedExchangeAdd64((volatile __int64*)p, (__int64)v);
+#else
+    __sync_fetch_and_add(p, v);
+#endif
+}
+
+
+/*
+* One bit per id telling whether it currently has a non-zero count, plus the number of set bits.
+* The analysis code tests the word of an id inline and only takes the atomic path on the first hit.
+* Words are created before the id is handed out, so pointers to them are stable.
+*/
+class PresenceBitmap
+{
+public:
+    //makes room for id, call before publishing the id
+    bool grow(size_t id)
+    {
+        while(words.size() * 64 <= id)
+            if(words.push_back(0) == decltype(words)::MAX_SIZE)
+                return false;
+        return true;
+    }
+
+    UINT64* word(UINT32 id) { return &words[id / 64]; }
+    static UINT64 mask(UINT32 id) { return UINT64(1) << (id % 64); }
+
+    bool test(UINT32 id) const { return words[id / 64] & mask(id); }
+
+    void set(UINT32 id)
+    {
+        if(!(atomic_or64(word(id), mask(id)) & mask(id)))
+            atomic_add64(&population, 1);
+    }
+
+    void clear(UINT32 id)
+    {
+        if(test(id) && (atomic_and64(word(id), ~mask(id)) & mask(id)))
+            atomic_add64(&population, -1);
+    }
+
+    void clearall()
+    {
+        const size_t n = words.size();
+        for(size_t w = 0; w < n; w++)
+            words[w] = 0;
+        population = 0;
+    }
+
+    //number of ids with a non-zero count, maintained incrementally
+    size_t count() const { return population < 0 ? 0 : (size_t)population; }
+
+    //calls f(id) for every set bit below limit, skipping empty words
+    template <typename F>
+    void foreach(size_t limit, F f) const
+    {
+        for(size_t w = 0; w * 64 < limit; w++)
+        {
+            UINT64 bits = words[w];
+            while(bits)
+            {
+                const UINT32 bit = lowest_bit64(bits);
+                bits &= bits - 1;
+                f(UINT32(w * 64 + bit));
+            }
+        }
+    }
+
+private:
+    ChunkedArray<UINT64, 10> words;
+    volatile INT64 population = 0;
+};
+
+
+/*
+* Interns strings (module names, paths and keys) and hands out dense ids.
+*/
+class StringTable
+{
+public:
+    UINT32 intern(const std::string& str)
+    {
+        auto it = index.find(str);
+        if(it != index.end())
+            return it->second;
+        const UINT32 id = (UINT32)strings.size();
+        strings.push_back(str);
+        index.emplace(str, id);
+        return id;
+    }
+
+    const std::string& get(UINT32 id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+
+private:
+    ChunkedArray<std::string, 10> strings;
+    std::unordered_map<std::string, UINT32> index;
+};
+
+
+/*
+* Keeps the values of the most recently used keys, up to a fixed capacity. Not thread safe.
+*/
+template <typename V>
+class LruCache
+{
+public:
+    explicit LruCache(size_t cap) : capacity(cap) {}
+
+    //returns nullptr if the key is not cached
+    const V* find(UINT32 key)
+    {
+        auto it = index.find(key);
+        if(it == index.end())
+            return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    void put(UINT32 key, const V& v)
+    {
+        erase(key);
+        entries.emplace_front(key, v);
+        index[key] = entries.begin();
+        if(entries.size() > capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    void erase(UINT32 key)
+    {
+        auto it = index.find(key);
+        if(it == index.end())
+            return;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+private:
+    typedef std::list<std::pair<UINT32, V>> List;
+    List entries; //most recent first
+    std::unordered_map<UINT32, typename List::iterator> index;
+    size_t capacity;
+};
+
+
+//data touched while the target runs or when sorting results
+struct RtnHot
+{
+    UINT32 flags = 0; //per-routine state bits
+    UINT64 firsthit = 0; //(collect window << 32) | sequence number of the first hit in that window
+};
+
+enum RtnFlags : UINT32
+{
+    RTN_FLAG_RETIRED = 1,  //trimmed and no longer instrumented (see retire command)
+    RTN_FLAG_FILTERED = 2, //module excluded by white/blacklist
+    RTN_FLAG_SATURATED = 4, //sample limit reached, not instrumented until the next collect window
+};
+
+//data only needed when printing results, the name is resolved on demand
+struct RtnCold
+{
+    UINT32 image = 0; //index in RoutineTable::images
+    UINT32 rva = 0;   //relative to ImageInfo::low
+};
+
+//a loaded module, filter decisions are made once per image
+struct ImageInfo
+{
+    UINT32 name = 0; //id in RoutineTable::strings
+    UINT32 path = 0; //id in RoutineTable::strings, full path of the file
+    UINT32 key = 0;  //id in RoutineTable::strings, identifies the file version (see SymCacheKey)
+    bool keyed = false; //key is only computed when it is needed
+    ADDRINT low = 0;
+    ADDRINT high = 0;
+    bool enabled = true;
+    UINT32 samplelimit = 0; //hits counted per routine and collect window, 0 = all (see sample command)
+};
+
+/*
+* Registry of all routines seen by the tool.
+* Every routine gets a dense id that indexes the hot and cold arrays (and the counter shards).
+* Only the instrumentation callbacks add routines, they are serialized by pin.
+* Routine names are not copied when a routine is registered. Almost all routines are trimmed
+* and never printed, so names are resolved by address when a row is printed and the most
+* recent ones are cached. Names that must outlive their image are kept for good (keepname).
+*/
+class RoutineTable
+{
+public:
+    static const UINT32 INVALID_ID = UINT32(-1);
+    static const size_t NAME_CACHE_SIZE = 4096;
+
+    //looks up the name of a routine (id and current address), empty if unknown
+    typedef std::string (*NameResolver)(UINT32 id, ADDRINT address);
+
+    RoutineTable() : names(NAME_CACHE_SIZE) {}
+
+    void init(NameResolver r)
+    {
+        PIN_InitLock(&namelock);
+        resolver = r;
+    }
+
+    //registers a loaded module, returns its index
+    UINT32 addimage(const std::string& name, const std::string& path, ADDRINT low, ADDRINT high, bool enabled)
+    {
+        ImageInfo info;
+        info.name = strings.intern(name);
+        info.path = strings.intern(path);
+        info.low = low;
+        info.high = high;
+        info.enabled = enabled;
+        return (UINT32)images.push_back(info);
+    }
+
+    //returns the id of the routine at adr, registering it if needed
+    UINT32 add(ADDRINT adr, UINT32 image)
+    {
+        const UINT32 flags = images[image].enabled ? 0 : RTN_FLAG_FILTERED;
+
+        auto it = byaddress.find(adr);
+        if(it != byaddress.end())
+        {
+            //same address seen again (e.g. module reloaded), keep the id but forget the name
+            RtnCold& c = cold[it->second];
+            c.image = image;
+            c.rva = (UINT32)(adr - images[image].low);
+            hot[it->second].flags = (hot[it->second].flags & ~RTN_FLAG_FILTERED) | flags;
+            PIN_GetLock(&namelock, PIN_ThreadId() + 1);
+            names.erase(it->second);
+            kept.erase(it->second);
+            PIN_ReleaseLock(&namelock);
+            return it->second;
+        }
+
+        RtnCold c;
+        c.image = image;
+        c.rva = (UINT32)(adr - images[image].low);
+
+        RtnHot h;
+        h.flags = flags;
+
+        if(!presence.grow(hot.size()))
+            return INVALID_ID;
+        const size_t id = hot.push_back(h);
+        if(id == decltype(hot)::MAX_SIZE)
+            return INVALID_ID;
+        cold.push_back(c);
+        byaddress.emplace(adr, (UINT32)id);
+        return (UINT32)id;
+    }
+
+    UINT32 find(ADDRINT adr) const
+    {
+        auto it = byaddress.find(adr);
+        return it == byaddress.end() ? INVALID_ID : it->second;
+    }
+
+    size_t size() const { return cold.size(); }
+    size_t imagecount() const { return images.size(); }
+
+    ImageInfo& imagedata(UINT32 image) { return images[image]; }
+    const std::string& imagename(UINT32 image) const { return strings.get(images[image].name); }
+    const std::string& imagepath(UINT32 image) const { return strings.get(images[image].path); }
+    bool haskey(UINT32 image) const { return images[image].keyed; }
+    const std::string& imagekey(UINT32 image) const { return strings.get(images[image].key); }
+    void setimagekey(UINT32 image, const std::string& key)
+    {
+        images[image].key = strings.intern(key);
+        images[image].keyed = true;
+    }
+
+    RtnHot& hotdata(UINT32 id) { return hot[id]; }
+    const RtnHot& hotdata(UINT32 id) const { return hot[id]; }
+    const RtnCold& colddata(UINT32 id) const { return cold[id]; }
+
+    ADDRINT address(UINT32 id) const { return images[cold[id].image].low + cold[id].rva; }
+    const std::string& image(UINT32 id) const { return strings.get(images[cold[id].image].name); }
+
+    //resolves the name if it is not cached, "???" if the routine is gone
+    std::string name(UINT32 id)
+    {
+        std::string s;
+        PIN_GetLock(&namelock, PIN_ThreadId() + 1);
+        const bool found = cachedname(id, s);
+        PIN_ReleaseLock(&namelock);
+        if(found)
+            return s;
+
+        s = lookup(id);
+        PIN_GetLock(&namelock, PIN_ThreadId() + 1);
+        names.put(id, s);
+        PIN_ReleaseLock(&namelock);
+        return s;
+    }
+
+    //like name(), but leaves the cache alone, for bulk passes that would only evict the recent names
+    std::string resolve(UINT32 id)
+    {
+        PIN_GetLock(&namelock, PIN_ThreadId() + 1);
+        auto it = kept.find(id);
+        const bool found = it != kept.end();
+        std::string s = found ? it->second : "";
+        PIN_ReleaseLock(&namelock);
+        return found ? s : lookup(id);
+    }
+
+    //keeps the name for good, e.g. before the image of the routine is unloaded
+    void keepname(UINT32 id)
+    {
+        const std::string s = name(id);
+        PIN_GetLock(&namelock, PIN_ThreadId() + 1);
+        kept[id] = s;
+        PIN_ReleaseLock(&namelock);
+    }
+
+    //routines with a non-zero count
+    PresenceBitmap presence;
+
+private:
+    ChunkedArray<RtnHot> hot;
+    ChunkedArray<RtnCold> cold;
+    StringTable strings;
+    ChunkedArray<ImageInfo, 8> images;
+    std::unordered_map<ADDRINT, UINT32> byaddress;
+
+    //the resolver may take other locks, so it is called without holding namelock
+    std::string lookup(UINT32 id)
+    {
+        const std::string s = resolver ? resolver(id, address(id)) : "";
+        return s.empty() ? "???" : s;
+    }
+
+    bool cachedname(UINT32 id, std::string& s)
+    {
+        auto it = kept.find(id);
+        if(it != kept.end())
+        {
+            s = it->second;
+            return true;
+        }
+        const std::string* cached = names.find(id);
+        if(cached)
+            s = *cached;
+        return cached != nullptr;
+    }
+
+    NameResolver resolver = nullptr;
+    LruCache<std::string> names;
+    std::unordered_map<UINT32, std::string> kept;
+    PIN_LOCK namelock;
+};
+
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef ROWWRITERH
+#define ROWWRITERH
+
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+
+//appends v in decimal, no allocation
+inline void append_dec(std::string& s, uint64_t v)
+{
+    char buf[20];
+    char* p = buf + sizeof(buf);
+    do
+    {
+        *--p = char('0' + v % 10);
+        v /= 10;
+    } while(v);
+    s.append(p, buf + sizeof(buf) - p);
+}
+
+//appends v in lowercase hex without prefix, same as tohex()
+inline void append_hex(std::string& s, uint64_t v)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[16];
+    char* p = buf + sizeof(buf);
+    do
+    {
+        *--p = digits[v & 0xf];
+        v >>= 4;
+    } while(v);
+    s.append(p, buf + sizeof(buf) - p);
+}
+
+
+/*
+* Formats table rows straight into one reusable buffer, replacing print_aligned + tohex for
+* large outputs (show, dump). Columns are right aligned to fixed widths and separated by a
+* space, like print_aligned. The buffer is handed to the stream in large chunks.
+*/
+template <typename Stream, size_t N>
+class RowWriter
+{
+public:
+    static const size_t CHUNK = 1 << 20;
+
+    RowWriter(Stream& s, const int (&w)[N]) : out(s)
+    {
+        std::memcpy(widths, w, sizeof(widths));
+    }
+
+    ~RowWriter() { flush(); }
+
+    void str(const char* t, size_t len)
+    {
+        pad(len);
+        buf.append(t, len);
+        buf += ' ';
+    }
+    void str(const char* t) { str(t, std::strlen(t)); }
+    void str(const std::string& t) { str(t.data(), t.size()); }
+
+    void dec(uint64_t v)
+    {
+        scratch.clear();
+        append_dec(scratch, v);
+        str(scratch);
+    }
+
+    void hex(uint64_t v)
+    {
+        scratch.clear();
+        append_hex(scratch, v);
+        str(scratch);
+    }
+
+    //ends the row, writes the buffer out once a chunk is full
+    void end()
+    {
+        buf += '\n';
+        col = 0;
+        if(buf.size() >= CHUNK)
+            flush();
+    }
+
+    //free form text between rows
+    void line(const std::string& t)
+    {
+        buf += t;
+        buf += '\n';
+    }
+
+    void flush()
+    {
+        if(!buf.empty())
+            out.write(buf.data(), buf.size());
+        buf.clear();
+    }
+
+private:
+    void pad(size_t len)
+    {
+        const size_t w = col < N ? (size_t)widths[col] : 0;
+        col++;
+        if(len < w)
+            buf.append(w - len, ' ');
+    }
+
+    Stream& out;
+    int widths[N];
+    size_t col = 0;
+    std::string buf;
+    std::string scratch;
+};
+
+
+#endif
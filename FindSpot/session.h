@@ -0,0 +1,135 @@
+#ifndef SESSIONH
+#define SESSIONH
+
+
+/*
+session file, written by "session save <file>" and read by "session load <file>"
+
+    SessionHeader
+    SessionModule[modules]        modules that have candidates
+    SessionEntry[entries]         candidates
+    char[stringbytes]             zero terminated module names and keys
+
+Candidates are stored relative to their module, so a session can be restored in a new run of the
+target despite ASLR. The module key (see SymCacheKey) makes sure the module was not rebuilt meanwhile.
+note: no pin types in here
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+#define SESSION_MAGIC "FSSESS1"
+#define SESSION_VERSION 1
+
+struct SessionHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t mode;        //0 off, 1 collect, 2 trim
+    uint64_t modules;
+    uint64_t modulesoffset;
+    uint64_t entries;
+    uint64_t entriesoffset;
+    uint64_t stringbytes;
+    uint64_t stringsoffset;
+};
+
+struct SessionModule
+{
+    uint32_t name; //byte offset into the strings
+    uint32_t key;  //byte offset into the strings, empty if the module file could not be identified
+};
+
+struct SessionEntry
+{
+    uint64_t rva;
+    uint64_t count;
+    uint32_t module; //index of the SessionModule
+    uint32_t reserved;
+};
+static_assert(sizeof(SessionEntry) == 24, "session entries are written as raw 24 byte blocks");
+
+
+struct Session
+{
+    uint32_t mode = 0;
+    std::vector<SessionModule> modules;
+    std::vector<SessionEntry> entries;
+    std::string strings;
+
+    const char* string(uint32_t offset) const
+    {
+        return offset < strings.size() ? strings.c_str() + offset : "";
+    }
+
+    //returns the index of a new module
+    uint32_t addmodule(const std::string& name, const std::string& key)
+    {
+        SessionModule m;
+        m.name = addstring(name);
+        m.key = addstring(key);
+        modules.push_back(m);
+        return (uint32_t)modules.size() - 1;
+    }
+
+private:
+    uint32_t addstring(const std::string& s)
+    {
+        const uint32_t offset = (uint32_t)strings.size();
+        strings.append(s);
+        strings.push_back('\0');
+        return offset;
+    }
+};
+
+template <typename Stream>
+void WriteSession(Stream& out, const Session& s)
+{
+    SessionHeader h{};
+    std::memcpy(h.magic, SESSION_MAGIC, sizeof(h.magic));
+    h.version = SESSION_VERSION;
+    h.mode = s.mode;
+    h.modules = s.modules.size();
+    h.modulesoffset = sizeof(SessionHeader);
+    h.entries = s.entries.size();
+    h.entriesoffset = h.modulesoffset + s.modules.size() * sizeof(SessionModule);
+    h.stringbytes = s.strings.size();
+    h.stringsoffset = h.entriesoffset + s.entries.size() * sizeof(SessionEntry);
+
+    out.write((const char*)&h, sizeof(h));
+    out.write((const char*)s.modules.data(), s.modules.size() * sizeof(SessionModule));
+    out.write((const char*)s.entries.data(), s.entries.size() * sizeof(SessionEntry));
+    out.write(s.strings.data(), s.strings.size());
+}
+
+//returns false if data is not a valid session file
+inline bool ReadSession(const std::string& data, Session& s)
+{
+    if(data.size() < sizeof(SessionHeader))
+        return false;
+    SessionHeader h;
+    std::memcpy(&h, data.data(), sizeof(h));
+    if(std::memcmp(h.magic, SESSION_MAGIC, sizeof(h.magic)) != 0 || h.version != SESSION_VERSION)
+        return false;
+    if(h.modulesoffset + h.modules * sizeof(SessionModule) > data.size()
+        || h.entriesoffset + h.entries * sizeof(SessionEntry) > data.size()
+        || h.stringsoffset + h.stringbytes > data.size())
+        return false;
+
+    s.mode = h.mode;
+    s.modules.resize(h.modules);
+    std::memcpy(s.modules.data(), data.data() + h.modulesoffset, h.modules * sizeof(SessionModule));
+    s.entries.resize(h.entries);
+    std::memcpy(s.entries.data(), data.data() + h.entriesoffset, h.entries * sizeof(SessionEntry));
+    s.strings.assign(data.data() + h.stringsoffset, h.stringbytes);
+    for(const SessionEntry& e : s.entries)
+        if(e.module >= h.modules)
+            return false;
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef SNAPSHOTH
+#define SNAPSHOTH
+
+
+#include <vector>
+#include <algorithm>
+
+#include "helper.h"
+
+
+/*
+* A saved candidate set: bitset of ids with a non-zero count plus the counts.
+* Both are dense arrays indexed by routine (or block) id, so the set operations are plain
+* word-wise loops that the compiler can vectorize.
+*/
+struct Snapshot
+{
+    std::vector<UINT64> bits;
+    std::vector<UINT64> counts;
+    bool blocks = false; //ids are block ids (bbl granularity) instead of routine ids
+
+    void resize(size_t ids)
+    {
+        counts.resize(ids);
+        bits.resize((ids + 63) / 64);
+    }
+
+    size_t size() const { return counts.size(); }
+
+    void set(size_t id, UINT64 count)
+    {
+        counts[id] = count;
+        if(count)
+            bits[id / 64] |= UINT64(1) << (id % 64);
+    }
+
+    size_t population() const
+    {
+        size_t n = 0;
+        for(UINT64 w : bits)
+            n += popcount64(w);
+        return n;
+    }
+
+    //calls f(id, count) for every id in the set
+    template <typename F>
+    void foreach(F f) const
+    {
+        for(size_t w = 0; w < bits.size(); w++)
+        {
+            UINT64 word = bits[w];
+            while(word)
+            {
+                const size_t id = w * 64 + lowest_bit64(word);
+                word &= word - 1;
+                f((UINT32)id, counts[id]);
+            }
+        }
+    }
+};
+
+
+enum class SnapshotOp
+{
+    AND,  //in both, lower count
+    OR,   //in either, counts added
+    DIFF, //in a but not in b, count of a
+};
+
+//builds a op b, both snapshots are extended to the same size first
+inline Snapshot CombineSnapshots(const Snapshot& a, const Snapshot& b, SnapshotOp op)
+{
+    const size_t ids = std::max(a.size(), b.size());
+    Snapshot x = a, y = b;
+    x.resize(ids);
+    y.resize(ids);
+
+    Snapshot r;
+    r.blocks = a.blocks;
+    r.resize(ids);
+
+    const size_t words = r.bits.size();
+    if(op == SnapshotOp::AND)
+    {
+        for(size_t i = 0; i < words; i++)
+            r.bits[i] = x.bits[i] & y.bits[i];
+        for(size_t i = 0; i < ids; i++)
+            r.counts[i] = std::min(x.counts[i], y.counts[i]);
+    }
+    else if(op == SnapshotOp::OR)
+    {
+        for(size_t i = 0; i < words; i++)
+            r.bits[i] = x.bits[i] | y.bits[i];
+        for(size_t i = 0; i < ids; i++)
+            r.counts[i] = x.counts[i] + y.counts[i];
+    }
+    else
+    {
+        for(size_t i = 0; i < words; i++)
+            r.bits[i] = x.bits[i] & ~y.bits[i];
+        for(size_t i = 0; i < ids; i++)
+            r.counts[i] = y.counts[i] ? 0 : x.counts[i];
+    }
+    return r;
+}
+
+
+#endif
@@ -61,6 +61,7 @@ static u_short(WSAAPI* p_htons)(u_short hostshort);
 #define __WSAFDIsSet p__WSAFDIsSet
 static int (WSAAPI* p__WSAFDIsSet)(WINDOWS::SOCKET fd, fd_set*);
 static int (WSAAPI* p_connect)(WINDOWS::SOCKET, const struct WINDOWS::sockaddr*, int);
+static int (WSAAPI* p_ioctlsocket)(WINDOWS::SOCKET s, long cmd, WINDOWS::u_long* argp);
 static unsigned long (WSAAPI* inet_addr)(const char*);
 
 bool init()
@@ -88,6 +89,7 @@ bool init()
 	*(WINDOWS::FARPROC*)&p_htons = GetProcAddress(h,("htons"));
 	*(WINDOWS::FARPROC*)&p__WSAFDIsSet = GetProcAddress(h,("__WSAFDIsSet"));
 	*(WINDOWS::FARPROC*)&p_connect = GetProcAddress(h,("connect"));
+	*(WINDOWS::FARPROC*)&p_ioctlsocket = GetProcAddress(h,("ioctlsocket"));
 	*(WINDOWS::FARPROC*)&inet_addr = GetProcAddress(h,("inet_addr"));
 
 
@@ -105,6 +107,7 @@ bool init()
 		|| p_htons == NULL
 		|| p__WSAFDIsSet == NULL
 		|| p_connect == NULL
+		|| p_ioctlsocket == NULL
 		|| inet_addr == NULL)
 	{
 		return false;
@@ -131,7 +134,10 @@ bool init() {
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 
 
 
@@ -161,13 +167,97 @@ int pin_send(PIN_SOCKET cli_socket, const char* buf, size_t n)
 #ifdef _WIN32
   ret = p_send(cli_socket, (const char *)buf, (int)n, 0);
 #else
+  //a controller that went away must not kill the target with SIGPIPE
   do
-    ret = send(cli_socket, buf, n, 0);
+    ret = send(cli_socket, buf, n, MSG_NOSIGNAL);
   while ( ret == -1 && errno == EINTR );
 #endif
   return ret;
 }
 
+//sends a and b as one gathered write (header + payload without copying), returns bytes sent
+//blocks until everything is sent, only for blocking sockets
+int pin_sendv(PIN_SOCKET fd, const char* a, size_t alen, const char* b, size_t blen)
+{
+#ifdef _WIN32
+  //no WSASend loaded, two sends are good enough here
+  int ra = pin_send(fd, a, alen);
+  if ( ra != (int)alen )
+    return ra;
+  int rb = pin_send(fd, b, blen);
+  return rb < 0 ? rb : ra + rb;
+#else
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)a;
+  iov[0].iov_len = alen;
+  iov[1].iov_base = (void*)b;
+  iov[1].iov_len = blen;
+  struct iovec *v = iov;
+  int cnt = 2;
+  size_t total = 0;
+  while ( cnt > 0 )
+  {
+    ssize_t ret;
+    struct msghdr msg = {};
+    msg.msg_iov = v;
+    msg.msg_iovlen = cnt;
+    do
+      ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    while ( ret == -1 && errno == EINTR );
+    if ( ret <= 0 )
+      return ret;
+    total += ret;
+    //skip what was written, partial writes are rare but possible
+    while ( cnt > 0 && (size_t)ret >= v->iov_len )
+    {
+      ret -= v->iov_len;
+      v++;
+      cnt--;
+    }
+    if ( cnt > 0 )
+    {
+      v->iov_base = (char*)v->iov_base + ret;
+      v->iov_len -= ret;
+    }
+  }
+  return (int)total;
+#endif
+}
+
+struct pin_iovec
+{
+  const char* base;
+  size_t len;
+};
+
+#define PIN_SENDV_MAX 64 //buffers per gathered write
+
+//one gathered write of up to PIN_SENDV_MAX buffers, returns bytes sent like pin_send (non blocking use)
+int pin_sendv_some(PIN_SOCKET fd, const pin_iovec* v, size_t cnt)
+{
+#ifdef _WIN32
+  //no WSASend loaded, the next buffer is sent on the next call
+  return cnt ? pin_send(fd, v[0].base, v[0].len) : 0;
+#else
+  struct iovec iov[PIN_SENDV_MAX];
+  if ( cnt > PIN_SENDV_MAX )
+    cnt = PIN_SENDV_MAX;
+  for ( size_t i = 0; i < cnt; i++ )
+  {
+    iov[i].iov_base = (void*)v[i].base;
+    iov[i].iov_len = v[i].len;
+  }
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = cnt;
+  ssize_t ret;
+  do
+    ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  while ( ret == -1 && errno == EINTR );
+  return (int)ret;
+#endif
+}
+
 int pin_recv(PIN_SOCKET fd, char* buf, size_t n)
 {
   char *bufp = (char*)buf;
@@ -192,5 +282,41 @@ int pin_recv(PIN_SOCKET fd, char* buf, size_t n)
 }
 
 
+//single read of whatever is available, <= 0 like recv()
+int pin_recv_some(PIN_SOCKET fd, char* buf, size_t n)
+{
+  int ret;
+#ifdef _WIN32
+  ret = p_recv(fd, buf, (int)n, 0);
+#else
+  do
+    ret = read(fd, buf, n);
+  while ( ret == -1 && errno == EINTR );
+#endif
+  return ret;
+}
+
+//true if the last failed send/recv on a non blocking socket only would have blocked
+bool pin_wouldblock()
+{
+#ifdef _WIN32
+  return p_WSAGetLastError() == 10035; //WSAEWOULDBLOCK
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool pin_setnonblocking(PIN_SOCKET fd)
+{
+#ifdef _WIN32
+  WINDOWS::u_long mode = 1;
+  return p_ioctlsocket(fd, 0x8004667E, &mode) == 0; //FIONBIO
+#else
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+
 #endif
 
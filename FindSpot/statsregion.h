@@ -0,0 +1,121 @@
+#ifndef STATSREGIONH
+#define STATSREGIONH
+
+
+/*
+live candidate table in a named posix shared memory segment, written by the pintool (-shm knob)
+and rendered by "findspot-cli watch <name>"
+
+    StatsHeader
+    DumpRow[rowcapacity]          current candidates, see dumpformat.h
+    char[stringcapacity]          zero terminated names, append only
+
+Unlike in a dump file, DumpRow::module and DumpRow::symbol are byte offsets into the string area.
+The writer makes seq odd while it updates the region, readers copy everything and retry if seq
+was odd or changed meanwhile (seqlock), so the target never waits for a reader.
+Readers bump readerpolls before every read (StatsPoll), the writer only updates the region after
+that counter changed, so nobody watching costs the target nothing.
+note: shared between the pintool and the standalone tools, so no pin types in here
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "dumpformat.h"
+
+
+#define STATS_MAGIC "FSSTATS"
+#define STATS_VERSION 2
+
+const uint64_t STATS_ROW_CAPACITY = 1 << 20;        //32MB of rows
+const uint64_t STATS_STRING_CAPACITY = 64ull << 20; //only touched pages are backed by memory
+const uint32_t STATS_NO_STRING = UINT32_MAX;
+
+struct StatsHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;       //DumpFlags
+    std::atomic<uint64_t> seq;
+    uint64_t rowcapacity;
+    uint64_t stringcapacity;
+    uint64_t rowsoffset;
+    uint64_t stringsoffset;
+    uint64_t rows;        //valid rows
+    uint64_t candidates;  //all candidates, more than rows if the row area is full
+    uint64_t stringbytes; //used part of the string area
+    uint64_t updates;
+    uint32_t mode;        //0 off, 1 collect, 2 trim
+    uint32_t reserved;
+    std::atomic<uint64_t> readerpolls; //written by readers
+};
+
+inline uint64_t StatsRegionSize()
+{
+    return sizeof(StatsHeader) + STATS_ROW_CAPACITY * sizeof(DumpRow) + STATS_STRING_CAPACITY;
+}
+
+inline const char* statsmodetostring(uint32_t mode)
+{
+    if(mode == 0)
+        return "off";
+    if(mode == 1)
+        return "collect";
+    if(mode == 2)
+        return "trim";
+    return "???";
+}
+
+
+//consistent copy of the region, taken by the reader
+struct StatsCopy
+{
+    StatsHeader header; //seq is meaningless in the copy
+    std::vector<DumpRow> rows;
+    std::string strings;
+
+    const char* string(uint32_t offset) const
+    {
+        return offset < strings.size() ? strings.c_str() + offset : "???";
+    }
+};
+
+//asks the writer for a fresh update, base must be mapped writable
+inline void StatsPoll(char* base)
+{
+    ((StatsHeader*)base)->readerpolls.fetch_add(1, std::memory_order_release);
+}
+
+//returns false if base is not a stats region or no consistent copy could be taken
+inline bool StatsRead(const char* base, StatsCopy& out, int retries = 100)
+{
+    const StatsHeader* h = (const StatsHeader*)base;
+    if(std::memcmp(h->magic, STATS_MAGIC, sizeof(h->magic)) != 0 || h->version != STATS_VERSION)
+        return false;
+
+    for(int i = 0; i < retries; i++)
+    {
+        const uint64_t seq = h->seq.load(std::memory_order_acquire);
+        if(seq & 1)
+            continue;
+
+        std::memcpy((void*)&out.header, (const void*)h, sizeof(StatsHeader));
+        const uint64_t rows = std::min(out.header.rows, out.header.rowcapacity);
+        const uint64_t bytes = std::min(out.header.stringbytes, out.header.stringcapacity);
+        out.rows.resize(rows);
+        std::memcpy(out.rows.data(), base + out.header.rowsoffset, rows * sizeof(DumpRow));
+        out.strings.assign(base + out.header.stringsoffset, bytes);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(h->seq.load(std::memory_order_relaxed) == seq)
+            return true;
+    }
+    return false;
+}
+
+
+#endif
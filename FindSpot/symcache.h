@@ -0,0 +1,277 @@
+#ifndef SYMCACHEH
+#define SYMCACHEH
+
+
+/*
+per image routine cache, written when an image is loaded for the first time and mmapped when it is
+loaded again in a later run (-symcache knob), so routine names are not resolved again
+
+    SymCacheHeader
+    SymCacheRow[rows]             routines in the order pin listed them
+    char[stringbytes]             zero terminated names
+
+There is one file per image version. It is named after the image and a key: the ELF build-id if
+the image has one, else file size and modification time.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+#define SYMCACHE_MAGIC "FSSYMC1"
+#define SYMCACHE_VERSION 1
+
+const size_t SYMCACHE_KEY_SIZE = 64;
+
+struct SymCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t rowsoffset;
+    uint64_t stringbytes;
+    uint64_t stringsoffset;
+    char key[SYMCACHE_KEY_SIZE]; //zero terminated
+};
+
+struct SymCacheRow
+{
+    uint64_t rva;  //relative to the low address of the image
+    uint32_t size;
+    uint32_t name; //byte offset into the strings
+};
+static_assert(sizeof(SymCacheRow) == 16, "cache rows are written as raw 16 byte blocks");
+
+
+//reads a little endian value of n bytes at offset, false if the file is too short
+inline bool read_at(std::ifstream& f, uint64_t offset, void* out, size_t n)
+{
+    f.clear();
+    f.seekg((std::streamoff)offset);
+    return (bool)f.read((char*)out, n);
+}
+
+//hex ELF build-id of the file, empty if it has none
+inline std::string ElfBuildId(const std::string& path)
+{
+    std::ifstream f(path.c_str(), std::ios::binary);
+    unsigned char ident[16];
+    if(!read_at(f, 0, ident, sizeof(ident)) || std::memcmp(ident, "\x7f" "ELF", 4) != 0)
+        return "";
+
+    const bool is64 = ident[4] == 2;
+    uint64_t phoff = 0;
+    uint16_t phentsize = 0, phnum = 0;
+    if(!read_at(f, is64 ? 0x20 : 0x1c, &phoff, is64 ? 8 : 4)
+        || !read_at(f, is64 ? 0x36 : 0x2a, &phentsize, 2)
+        || !read_at(f, is64 ? 0x38 : 0x2c, &phnum, 2))
+        return "";
+
+    for(uint16_t i = 0; i < phnum; i++)
+    {
+        const uint64_t ph = phoff + (uint64_t)i * phentsize;
+        uint32_t type = 0;
+        uint64_t offset = 0, filesz = 0;
+        if(!read_at(f, ph, &type, 4)
+            || !read_at(f, ph + (is64 ? 8 : 4), &offset, is64 ? 8 : 4)
+            || !read_at(f, ph + (is64 ? 0x20 : 0x10), &filesz, is64 ? 8 : 4))
+            return "";
+        if(type != 4 || filesz > 0x10000) //PT_NOTE
+            continue;
+
+        std::string notes(filesz, '\0');
+        if(!read_at(f, offset, &notes[0], notes.size()))
+            continue;
+        for(size_t pos = 0; pos + 12 <= notes.size();)
+        {
+            uint32_t namesz, descsz, notetype;
+            std::memcpy(&namesz, &notes[pos], 4);
+            std::memcpy(&descsz, &notes[pos + 4], 4);
+            std::memcpy(&notetype, &notes[pos + 8], 4);
+            const size_t name = pos + 12;
+            const size_t desc = name + ((namesz + 3) & ~3u);
+            if(desc + descsz > notes.size())
+                break;
+            if(notetype == 3 && namesz == 4 && std::memcmp(&notes[name], "GNU", 4) == 0) //NT_GNU_BUILD_ID
+            {
+                static const char digits[] = "0123456789abcdef";
+                std::string id;
+                for(size_t b = 0; b < descsz; b++)
+                {
+                    id += digits[(unsigned char)notes[desc + b] >> 4];
+                    id += digits[(unsigned char)notes[desc + b] & 0xf];
+                }
+                return id;
+            }
+            pos = desc + ((descsz + 3) & ~3u);
+        }
+    }
+    return "";
+}
+
+//identifies the version of an image file, empty if the file can not be read (e.g. [vdso])
+inline std::string SymCacheKey(const std::string& path)
+{
+    const std::string id = ElfBuildId(path);
+    if(!id.empty())
+        return ("b" + id).substr(0, SYMCACHE_KEY_SIZE - 1);
+
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0)
+        return "";
+    char key[SYMCACHE_KEY_SIZE];
+    std::snprintf(key, sizeof(key), "m%llx-%llx", (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
+    return key;
+}
+
+
+//collects the routines of an image while pin lists them
+class SymCacheWriter
+{
+public:
+    void add(uint64_t rva, uint32_t size, const std::string& name)
+    {
+        SymCacheRow row;
+        row.rva = rva;
+        row.size = size;
+        row.name = (uint32_t)strings.size();
+        rows.push_back(row);
+        strings.append(name);
+        strings.push_back('\0');
+    }
+
+    //writes to a temporary file first, so a concurrent run never maps a partial cache
+    bool write(const std::string& path, const std::string& key) const
+    {
+        SymCacheHeader h{};
+        std::memcpy(h.magic, SYMCACHE_MAGIC, sizeof(h.magic));
+        h.version = SYMCACHE_VERSION;
+        h.rows = rows.size();
+        h.rowsoffset = sizeof(SymCacheHeader);
+        h.stringbytes = strings.size();
+        h.stringsoffset = h.rowsoffset + rows.size() * sizeof(SymCacheRow);
+        std::strncpy(h.key, key.c_str(), sizeof(h.key) - 1);
+
+        const std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary);
+            if(!out.is_open())
+                return false;
+            out.write((const char*)&h, sizeof(h));
+            out.write((const char*)rows.data(), rows.size() * sizeof(SymCacheRow));
+            out.write(strings.data(), strings.size());
+            if(!out)
+                return false;
+        }
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    std::vector<SymCacheRow> rows;
+    std::string strings;
+};
+
+
+//read only view of a cache file, mmapped where possible
+class SymCacheView
+{
+public:
+    SymCacheView() = default;
+    SymCacheView(const SymCacheView&) = delete;
+    SymCacheView& operator=(const SymCacheView&) = delete;
+    ~SymCacheView() { close(); }
+
+    //returns false if there is no valid cache for this key
+    bool open(const std::string& path, const std::string& key)
+    {
+        close();
+#ifndef _WIN32
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SymCacheHeader))
+        {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED)
+            {
+                base = (const char*)p;
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+#else
+        std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+        if(!in.is_open())
+            return false;
+        copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        base = copy.data();
+        size = copy.size();
+#endif
+        if(!base || !valid(key))
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifndef _WIN32
+        if(base)
+            munmap((void*)base, size);
+#else
+        copy.clear();
+#endif
+        base = nullptr;
+        size = 0;
+    }
+
+    uint64_t rows() const { return header()->rows; }
+    const SymCacheRow& row(uint64_t i) const { return ((const SymCacheRow*)(base + header()->rowsoffset))[i]; }
+    const char* name(const SymCacheRow& r) const
+    {
+        return r.name < header()->stringbytes ? base + header()->stringsoffset + r.name : "???";
+    }
+
+private:
+    const SymCacheHeader* header() const { return (const SymCacheHeader*)base; }
+
+    bool valid(const std::string& key) const
+    {
+        if(size < sizeof(SymCacheHeader))
+            return false;
+        const SymCacheHeader* h = header();
+        if(std::memcmp(h->magic, SYMCACHE_MAGIC, sizeof(h->magic)) != 0 || h->version != SYMCACHE_VERSION)
+            return false;
+        if(std::strncmp(h->key, key.c_str(), sizeof(h->key)) != 0)
+            return false;
+        if(h->rowsoffset + h->rows * sizeof(SymCacheRow) > size || h->stringsoffset + h->stringbytes > size)
+            return false;
+        return h->stringbytes == 0 || base[h->stringsoffset + h->stringbytes - 1] == '\0';
+    }
+
+    const char* base = nullptr;
+    uint64_t size = 0;
+#ifdef _WIN32
+    std::string copy;
+#endif
+};
+
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef TRACELOGH
+#define TRACELOGH
+
+
+/*
+binary event log, written by the pintool (-b knob) and rendered by findspot-trace
+note: shared between the pintool and the standalone tools, so no pin types in here
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+
+#define TRACE_MAGIC "FSTRACE"
+#define TRACE_VERSION 1
+
+
+enum TraceKind : uint8_t
+{
+    TRACE_IGNORED = 0, //hit while mode is OFF
+    TRACE_COLLECT = 1,
+    TRACE_TRIM = 2,
+};
+
+inline const char* tracekindtostring(uint8_t kind)
+{
+    if(kind == TRACE_IGNORED)
+        return "ignored";
+    if(kind == TRACE_COLLECT)
+        return "collect";
+    if(kind == TRACE_TRIM)
+        return "trimmed";
+    return "???";
+}
+
+struct TraceFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordsize;
+    uint64_t tscstart;
+};
+
+//one fixed size record per routine hit
+struct TraceRecord
+{
+    uint64_t tsc;
+    uint32_t routine; //routine id, resolved through the .sym file
+    uint16_t thread;
+    uint8_t kind;     //TraceKind
+    uint8_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 16, "trace records are written as raw 16 byte blocks");
+
+inline uint64_t ReadTsc()
+{
+    return __rdtsc();
+}
+
+
+/*
+* Single producer / single consumer ring of trace records.
+* The producer is the owning application thread, the consumer is the drain thread.
+* When the ring is full new records are dropped and counted instead of blocking the target.
+*/
+class TraceRing
+{
+public:
+    static const uint64_t CAPACITY = 1 << 16; //1MB per thread
+
+    explicit TraceRing(uint16_t tid) : thread(tid) {}
+
+    void push(uint32_t routine, uint8_t kind)
+    {
+        const uint64_t h = head.load(std::memory_order_relaxed);
+        if(h - tail.load(std::memory_order_acquire) >= CAPACITY)
+        {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        TraceRecord& r = records[h & (CAPACITY - 1)];
+        r.tsc = ReadTsc();
+        r.routine = routine;
+        r.thread = thread;
+        r.kind = kind;
+        r.reserved = 0;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    //copies up to max records into out, returns the number copied
+    size_t pop(TraceRecord* out, size_t max)
+    {
+        const uint64_t t = tail.load(std::memory_order_relaxed);
+        const uint64_t h = head.load(std::memory_order_acquire);
+        size_t n = 0;
+        for(uint64_t i = t; i != h && n < max; i++, n++)
+            out[n] = records[i & (CAPACITY - 1)];
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    uint64_t droppedcount() const { return dropped.load(std::memory_order_relaxed); }
+
+    //the owning thread exited, called by it after its last push
+    void close() { closed.store(true, std::memory_order_release); }
+    bool isclosed() const { return closed.load(std::memory_order_acquire); }
+
+    //hands a closed and drained ring to a new thread
+    void reuse(uint16_t tid)
+    {
+        thread = tid;
+        dropped.store(0, std::memory_order_relaxed);
+        closed.store(false, std::memory_order_relaxed);
+    }
+
+private:
+    TraceRecord records[CAPACITY];
+    uint16_t thread;
+    std::atomic<bool> closed{false};
+    std::atomic<uint64_t> head{0};
+    char pad[56]; //keep producer and consumer index on separate cache lines
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+
+#endif
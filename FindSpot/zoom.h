@@ -0,0 +1,88 @@
+#ifndef ZOOMH
+#define ZOOMH
+
+
+#include <map>
+
+#include "routinetable.h"
+
+
+const UINT32 ZOOM_CALLSITES = 64;  //distinct return addresses per routine, more go to "other"
+const UINT32 ZOOM_RING = 16;       //argument sets kept per routine
+const UINT32 ZOOM_MAX_ARGS = 6;    //argument registers that can be recorded
+
+
+/*
+* Fixed size table of call sites (return addresses) and their counts.
+* Slots are claimed with a compare and swap, so threads never wait for each other.
+*/
+class CallSiteTable
+{
+public:
+    void hit(ADDRINT ret)
+    {
+        const UINT32 start = UINT32((ret >> 2) % ZOOM_CALLSITES);
+        for(UINT32 i = 0; i < ZOOM_CALLSITES; i++)
+        {
+            Slot& s = slots[(start + i) % ZOOM_CALLSITES];
+            if(s.address == 0)
+                atomic_cas64((UINT64*)&s.address, 0, ret); //another thread may win, checked below
+            if(s.address == ret)
+            {
+                atomic_add64(&s.count, 1);
+                return;
+            }
+        }
+        atomic_add64(&other, 1);
+    }
+
+    //calls f(return address, count) for every call site
+    template <typename F>
+    void foreach(F f) const
+    {
+        for(const Slot& s : slots)
+            if(s.address)
+                f((ADDRINT)s.address, (UINT64)s.count);
+    }
+
+    UINT64 overflow() const { return (UINT64)other; }
+
+private:
+    struct Slot
+    {
+        volatile UINT64 address = 0;
+        volatile INT64 count = 0;
+    };
+    Slot slots[ZOOM_CALLSITES];
+    volatile INT64 other = 0;
+};
+
+
+/*
+* Everything recorded about one zoomed routine.
+* Block counters are created while jitting (serialized by pin) and never move.
+*/
+struct ZoomRoutine
+{
+    UINT32 id = 0;                          //id in the RoutineTable
+    volatile INT64 calls = 0;
+    std::map<ADDRINT, INT64> blocks;        //basic block address -> executions
+    CallSiteTable callsites;
+    ADDRINT args[ZOOM_RING][ZOOM_MAX_ARGS]; //most recent argument sets, may be torn by racing threads
+    volatile UINT32 argpos = 0;             //number of sets recorded so far
+
+    ZoomRoutine() : args() {}
+
+    //counter of a block, created on first use
+    volatile INT64* block(ADDRINT adr) { return &blocks[adr]; }
+
+    void record_args(const ADDRINT* a, UINT32 n)
+    {
+        const UINT32 slot = atomic_next32(&argpos) % ZOOM_RING;
+        for(UINT32 i = 0; i < n && i < ZOOM_MAX_ARGS; i++)
+            args[slot][i] = a[i];
+    }
+};
+
+
+#endif